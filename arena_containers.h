@@ -0,0 +1,342 @@
+/* arena_containers.h -- Containers allocated from a scratch arena
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ARENA_CONTAINERS_H
+#define ARENA_CONTAINERS_H
+
+#include <stdarg.h>
+
+#include "scratch_allocator.h"
+
+#define ARENA_MIN_CAPACITY 8
+
+/* Containers whose storage lives in a scratch arena.
+ *
+ * There is no destroy function: the memory of a container goes away with the next
+ * scratch_heap_reset() or scratch_heap_term() of its arena, so a container must not be
+ * used after its arena is reset.
+ * Growing a container resizes its storage in place when the storage is the last
+ * allocation of the arena (see scratch_realloc()), otherwise the storage is copied
+ * and the old copy is left in the arena until reset.
+ *
+ *      arena_vec  -- growable array of fixed-size elements
+ *      arena_map  -- open-addressing (linear probing) map from 64-bit keys to pointers
+ *      arena_str  -- NUL-terminated string builder
+ */
+
+struct arena_vec {
+        struct scratch_heap     *scr;
+        void                    *data;
+        size_t                  elem_size;
+        size_t                  alignment;
+        size_t                  len;
+        size_t                  cap;
+};
+
+struct arena_map_entry {
+        uint64_t                key;
+        void                    *value;
+};
+
+struct arena_map {
+        struct scratch_heap     *scr;
+        struct arena_map_entry  *entries;
+        uint8_t                 *used;
+        size_t                  len;
+        size_t                  cap;
+};
+
+struct arena_str {
+        struct scratch_heap     *scr;
+        char                    *data;
+        size_t                  len;
+        size_t                  cap;
+};
+
+void arena_vec_init(struct arena_vec *v, struct scratch_heap *scr, size_t elem_size, size_t alignment)
+{
+        v->scr = scr;
+        v->data = NULL;
+        v->elem_size = elem_size;
+        v->alignment = alignment;
+        v->len = 0;
+        v->cap = 0;
+}
+
+int arena_vec_reserve(struct arena_vec *v, size_t cap)
+{
+        if (cap <= v->cap)
+                return 0;
+
+        void *data = scratch_realloc(v->scr, v->data, v->cap * v->elem_size, cap * v->elem_size, v->alignment);
+
+        if (data == NULL)
+                return -1;
+
+        v->data = data;
+        v->cap = cap;
+
+        return 0;
+}
+
+/* append an uninitialized element. returns its address or NULL if the arena is full */
+void *arena_vec_push(struct arena_vec *v)
+{
+        if (v->len == v->cap) {
+                const size_t cap = (v->cap == 0) ? ARENA_MIN_CAPACITY : v->cap * 2;
+
+                if (arena_vec_reserve(v, cap) != 0)
+                        return NULL;
+        }
+
+        return (void *)((uintptr_t)v->data + (v->len++ * v->elem_size));
+}
+
+void *arena_vec_at(struct arena_vec *v, size_t i)
+{
+        if (i >= v->len)
+                return NULL;
+
+        return (void *)((uintptr_t)v->data + (i * v->elem_size));
+}
+
+void arena_vec_pop(struct arena_vec *v)
+{
+        if (v->len > 0)
+                v->len--;
+}
+
+/* finalizer of murmur3 */
+uint64_t arena_hash64(uint64_t k)
+{
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ULL;
+        k ^= k >> 33;
+
+        return k;
+}
+
+/* FNV-1a, to turn a string or a buffer into a map key */
+uint64_t arena_hash_bytes(const void *ptr, size_t nbytes)
+{
+        const uint8_t *p = ptr;
+        uint64_t h = 0xcbf29ce484222325ULL;
+
+        for (size_t i = 0; i < nbytes; i++) {
+                h ^= p[i];
+                h *= 0x100000001b3ULL;
+        }
+
+        return h;
+}
+
+int arena_map_alloc_table(struct arena_map *m, size_t cap)
+{
+        m->entries = scratch_alloc(m->scr, cap * sizeof(struct arena_map_entry), _Alignof(struct arena_map_entry));
+        m->used = scratch_alloc(m->scr, cap, 1);
+
+        if (m->entries == NULL || m->used == NULL)
+                return -1;
+
+        memset(m->used, 0, cap);
+        m->cap = cap;
+        m->len = 0;
+
+        return 0;
+}
+
+/* cap is rounded up to a power of 2 */
+int arena_map_init(struct arena_map *m, struct scratch_heap *scr, size_t cap)
+{
+        m->scr = scr;
+
+        if (cap < ARENA_MIN_CAPACITY)
+                cap = ARENA_MIN_CAPACITY;
+
+        return arena_map_alloc_table(m, pow2_roundup(cap));
+}
+
+size_t arena_map_slot(struct arena_map *m, uint64_t key)
+{
+        size_t i = arena_hash64(key) & (m->cap - 1);
+
+        while (m->used[i] && m->entries[i].key != key)
+                i = (i + 1) & (m->cap - 1);
+
+        return i;
+}
+
+void *arena_map_get(struct arena_map *m, uint64_t key)
+{
+        const size_t i = arena_map_slot(m, key);
+
+        return m->used[i] ? m->entries[i].value : NULL;
+}
+
+int arena_map_grow(struct arena_map *m)
+{
+        struct arena_map_entry *entries = m->entries;
+        uint8_t *used = m->used;
+        const size_t cap = m->cap;
+
+        if (arena_map_alloc_table(m, cap * 2) != 0) {
+                m->entries = entries;
+                m->used = used;
+                m->cap = cap;
+                return -1;
+        }
+
+        for (size_t i = 0; i < cap; i++) {
+                if (!used[i])
+                        continue;
+
+                const size_t j = arena_map_slot(m, entries[i].key);
+
+                m->entries[j] = entries[i];
+                m->used[j] = 1;
+                m->len++;
+        }
+
+        return 0;
+}
+
+/* insert or replace. the table is grown above a load factor of 3/4 */
+int arena_map_put(struct arena_map *m, uint64_t key, void *value)
+{
+        if ((m->len + 1) * 4 > m->cap * 3 && arena_map_grow(m) != 0)
+                return -1;
+
+        const size_t i = arena_map_slot(m, key);
+
+        if (!m->used[i]) {
+                m->used[i] = 1;
+                m->entries[i].key = key;
+                m->len++;
+        }
+
+        m->entries[i].value = value;
+
+        return 0;
+}
+
+/* remove with backward shift, so that no tombstone is left in the table */
+void arena_map_remove(struct arena_map *m, uint64_t key)
+{
+        size_t i = arena_map_slot(m, key);
+
+        if (!m->used[i])
+                return;
+
+        const size_t mask = m->cap - 1;
+        size_t j = i;
+
+        for (;;) {
+                j = (j + 1) & mask;
+
+                if (!m->used[j])
+                        break;
+
+                /* move entry j to the hole if its home slot is not in (i, j] */
+                const size_t home = arena_hash64(m->entries[j].key) & mask;
+
+                if (((j - home) & mask) >= ((j - i) & mask)) {
+                        m->entries[i] = m->entries[j];
+                        i = j;
+                }
+        }
+
+        m->used[i] = 0;
+        m->len--;
+}
+
+int arena_str_init(struct arena_str *s, struct scratch_heap *scr)
+{
+        s->scr = scr;
+        s->len = 0;
+        s->cap = ARENA_MIN_CAPACITY;
+        s->data = scratch_alloc(scr, s->cap, 1);
+
+        if (s->data == NULL)
+                return -1;
+
+        s->data[0] = '\0';
+
+        return 0;
+}
+
+int arena_str_reserve(struct arena_str *s, size_t len)
+{
+        if (len + 1 <= s->cap)
+                return 0;
+
+        size_t cap = s->cap;
+
+        while (cap < len + 1)
+                cap *= 2;
+
+        char *data = scratch_realloc(s->scr, s->data, s->cap, cap, 1);
+
+        if (data == NULL)
+                return -1;
+
+        s->data = data;
+        s->cap = cap;
+
+        return 0;
+}
+
+int arena_str_append(struct arena_str *s, const char *str, size_t n)
+{
+        if (arena_str_reserve(s, s->len + n) != 0)
+                return -1;
+
+        memcpy(s->data + s->len, str, n);
+        s->len += n;
+        s->data[s->len] = '\0';
+
+        return 0;
+}
+
+int arena_str_appendf(struct arena_str *s, const char *fmt, ...)
+{
+        va_list ap;
+
+        va_start(ap, fmt);
+        const int n = vsnprintf(NULL, 0, fmt, ap);
+        va_end(ap);
+
+        if (n < 0 || arena_str_reserve(s, s->len + n) != 0)
+                return -1;
+
+        va_start(ap, fmt);
+        vsnprintf(s->data + s->len, n + 1, fmt, ap);
+        va_end(ap);
+
+        s->len += n;
+
+        return 0;
+}
+
+#endif
@@ -0,0 +1,451 @@
+/* fragmentation.c -- long-running synthetic workloads against the allocators
+ *
+ * Each thread runs its own allocator instance through a sequence of phases. A phase
+ * draws object sizes and lifetimes from parameterized distributions; time is simulated
+ * in ticks, every tick allocates a number of objects and frees the objects whose
+ * lifetime has expired. At every sample interval a CSV line is printed with the live
+ * bytes, the footprint of the allocator, the fragmentation (1 - live / footprint), the
+ * resident set size of the process and the throughput since the previous sample.
+ * The footprint of malloc is not observable, it is reported as the live bytes and only
+ * the resident set size compares with the other engines.
+ *
+ * build: cc -O2 -I.. fragmentation.c -o fragmentation -lpthread -lm
+ * usage: fragmentation [-e buddy|slab|extent|scratch|malloc] [-t threads]
+ *                      [-n ticks per phase] [-s sample interval] [-r allocs per tick]
+ *                      [-S seed]
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+
+#include "buddy_allocator.h"
+#include "slab_allocator.h"
+#include "extent_allocator.h"
+#include "scratch_allocator.h"
+
+enum dist_kind {
+        DIST_UNIFORM,
+        DIST_POWERLAW,
+        DIST_BIMODAL,
+        DIST_EXPONENTIAL
+};
+
+/* uniform: [a, b]. powerlaw: pareto of minimum a, exponent p, capped at b.
+ * bimodal: a with probability p, else b. exponential: mean a, capped at b */
+struct dist {
+        enum dist_kind  kind;
+        double          a;
+        double          b;
+        double          p;
+};
+
+struct phase {
+        const char      *name;
+        struct dist     size;
+        struct dist     lifetime;
+};
+
+static const struct phase phases[] = {
+        { "uniform",  { DIST_UNIFORM, 16, 512, 0 },       { DIST_EXPONENTIAL, 200, 5000, 0 } },
+        { "powerlaw", { DIST_POWERLAW, 16, 65536, 1.3 },  { DIST_POWERLAW, 10, 100000, 1.1 } },
+        { "bimodal",  { DIST_BIMODAL, 48, 3000, 0.9 },    { DIST_BIMODAL, 50, 20000, 0.8 } },
+        { "longtail", { DIST_UNIFORM, 16, 256, 0 },       { DIST_POWERLAW, 100, 1000000, 0.8 } }
+};
+
+#define NPHASES (sizeof(phases) / sizeof(phases[0]))
+
+struct config {
+        const char      *engine;
+        int             threads;
+        unsigned long   ticks;
+        unsigned long   sample;
+        unsigned        rate;
+        unsigned        seed;
+};
+
+/* engines ---------------------------------------------------------------- */
+
+struct engine {
+        struct heap             h;
+        struct buddy_heap       buddy;
+        struct slab_heap        slab;
+        struct extent_heap      extent;
+        struct scratch_chain    scratch;
+        size_t                  scratch_live;
+        size_t                  footprint;
+        int                     kind;
+};
+
+enum engine_kind {
+        E_BUDDY,
+        E_SLAB,
+        E_EXTENT,
+        E_SCRATCH,
+        E_MALLOC
+};
+
+static int engine_init(struct engine *e, const char *name)
+{
+        memset(e, 0, sizeof(*e));
+        heap_init(&e->h, 0);
+
+        if (strcmp(name, "buddy") == 0) {
+                e->kind = E_BUDDY;
+                return buddy_heap_init(&e->buddy, &e->h, 28, 16);
+        }
+        if (strcmp(name, "slab") == 0) {
+                e->kind = E_SLAB;
+                return slab_heap_init(&e->slab, &e->h, 16);
+        }
+        if (strcmp(name, "extent") == 0) {
+                e->kind = E_EXTENT;
+                return extent_heap_init(&e->extent, &e->h, 1 << 16);
+        }
+        if (strcmp(name, "scratch") == 0) {
+                e->kind = E_SCRATCH;
+                return scratch_chain_init(&e->scratch, &e->h, 1 << 20, 16);
+        }
+        if (strcmp(name, "malloc") == 0) {
+                e->kind = E_MALLOC;
+                return 0;
+        }
+
+        return -1;
+}
+
+static void *engine_alloc(struct engine *e, size_t n)
+{
+        void *ptr = NULL;
+
+        switch (e->kind) {
+        case E_BUDDY:
+                ptr = buddy_alloc(&e->buddy, n);
+                break;
+        case E_SLAB:
+                /* above the largest class, as a router would do */
+                ptr = (n <= bit(SLAB_MAX_SHIFT)) ? slab_alloc(&e->slab, n) : malloc(n);
+                if (ptr != NULL && n > bit(SLAB_MAX_SHIFT))
+                        e->footprint += n;
+                break;
+        case E_EXTENT:
+                ptr = extent_alloc(&e->extent, extent_npages(n));
+                break;
+        case E_SCRATCH:
+                ptr = scratch_chain_alloc(&e->scratch, n, 16);
+                e->scratch_live += (ptr != NULL);
+                break;
+        case E_MALLOC:
+                ptr = malloc(n);
+                break;
+        }
+
+        return ptr;
+}
+
+static void engine_free(struct engine *e, void *ptr, size_t n)
+{
+        switch (e->kind) {
+        case E_BUDDY:
+                buddy_free(&e->buddy, ptr);
+                break;
+        case E_SLAB:
+                if (n <= bit(SLAB_MAX_SHIFT)) {
+                        slab_free_sized(&e->slab, ptr, n, 0);
+                } else {
+                        free(ptr);
+                        e->footprint -= n;
+                }
+                break;
+        case E_EXTENT:
+                extent_free(&e->extent, ptr, extent_npages(n));
+                break;
+        case E_SCRATCH:
+                /* an arena goes away once all of its objects are dead */
+                if (--e->scratch_live == 0)
+                        scratch_chain_reset(&e->scratch);
+                break;
+        case E_MALLOC:
+                free(ptr);
+                break;
+        }
+}
+
+/* bytes held by the engine, live or not */
+static size_t engine_footprint(struct engine *e, size_t live)
+{
+        size_t n = 0;
+
+        switch (e->kind) {
+        case E_BUDDY:
+                /* the arena minus its free blocks */
+                n = bit(e->buddy.k);
+                for (int k = 0; k < BUDDY_MAX_K; k++) {
+                        for (struct list_node *p = e->buddy.nodes[k].head; p != NULL; p = p->next)
+                                n -= bit(e->buddy.k - k);
+                }
+                return n;
+        case E_SLAB:
+                return e->slab.nbytes + e->footprint;
+        case E_EXTENT:
+                return (e->extent.npages - e->extent.free_pages) * HEAP_PAGE_SIZE;
+        case E_SCRATCH:
+                for (struct scratch_chunk *c = e->scratch.chunks; c != NULL; c = c->next)
+                        n += (uintptr_t)c->scr.tail - (uintptr_t)c->scr.mem;
+                return n;
+        default:
+                return live;
+        }
+}
+
+static void engine_term(struct engine *e)
+{
+        switch (e->kind) {
+        case E_BUDDY:
+                buddy_heap_term(&e->buddy, &e->h);
+                break;
+        case E_SLAB:
+                slab_heap_term(&e->slab);
+                break;
+        case E_EXTENT:
+                extent_heap_term(&e->extent);
+                break;
+        case E_SCRATCH:
+                scratch_chain_term(&e->scratch);
+                break;
+        }
+}
+
+/* workload --------------------------------------------------------------- */
+
+struct object {
+        unsigned long   death;
+        void            *ptr;
+        size_t          nbytes;
+};
+
+/* binary min-heap of live objects ordered by time of death */
+struct live_set {
+        struct object   *objs;
+        size_t          len;
+        size_t          cap;
+        size_t          bytes;
+};
+
+static double urand(unsigned *seed)
+{
+        return (rand_r(seed) + 1.0) / ((double)RAND_MAX + 2.0);
+}
+
+static double dist_draw(const struct dist *d, unsigned *seed)
+{
+        double x = 0;
+
+        switch (d->kind) {
+        case DIST_UNIFORM:
+                x = d->a + urand(seed) * (d->b - d->a);
+                break;
+        case DIST_POWERLAW:
+                x = d->a / pow(urand(seed), 1.0 / d->p);
+                break;
+        case DIST_BIMODAL:
+                x = (urand(seed) < d->p) ? d->a : d->b;
+                break;
+        case DIST_EXPONENTIAL:
+                x = -d->a * log(urand(seed));
+                break;
+        }
+
+        return (x > d->b && d->kind != DIST_BIMODAL) ? d->b : x;
+}
+
+static void live_push(struct live_set *s, struct object o)
+{
+        if (s->len == s->cap) {
+                s->cap = s->cap ? s->cap * 2 : 1024;
+                s->objs = realloc(s->objs, s->cap * sizeof(struct object));
+        }
+
+        size_t i = s->len++;
+
+        while (i > 0 && s->objs[(i - 1) / 2].death > o.death) {
+                s->objs[i] = s->objs[(i - 1) / 2];
+                i = (i - 1) / 2;
+        }
+
+        s->objs[i] = o;
+        s->bytes += o.nbytes;
+}
+
+static struct object live_pop(struct live_set *s)
+{
+        struct object top = s->objs[0], last = s->objs[--s->len];
+        size_t i = 0;
+
+        for (;;) {
+                size_t c = 2 * i + 1;
+
+                if (c >= s->len)
+                        break;
+                if (c + 1 < s->len && s->objs[c + 1].death < s->objs[c].death)
+                        c++;
+                if (s->objs[c].death >= last.death)
+                        break;
+
+                s->objs[i] = s->objs[c];
+                i = c;
+        }
+
+        if (s->len > 0)
+                s->objs[i] = last;
+
+        s->bytes -= top.nbytes;
+
+        return top;
+}
+
+static size_t rss_bytes(void)
+{
+        long pages = 0, resident = 0;
+        FILE *f = fopen("/proc/self/statm", "r");
+
+        if (f == NULL)
+                return 0;
+
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+                resident = 0;
+
+        fclose(f);
+
+        return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct worker {
+        pthread_t               thread;
+        int                     id;
+        const struct config     *cfg;
+};
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *worker_run(void *arg)
+{
+        struct worker *w = arg;
+        const struct config *cfg = w->cfg;
+        struct engine e;
+        struct live_set live = { 0 };
+        unsigned seed = cfg->seed + w->id;
+        unsigned long tick = 0, ops = 0, failures = 0;
+        double t0 = now();
+
+        if (engine_init(&e, cfg->engine) != 0) {
+                fprintf(stderr, "fragmentation: cannot init engine %s\n", cfg->engine);
+                return NULL;
+        }
+
+        for (size_t p = 0; p < NPHASES; p++) {
+                for (unsigned long t = 0; t < cfg->ticks; t++, tick++) {
+                        while (live.len > 0 && live.objs[0].death <= tick) {
+                                struct object o = live_pop(&live);
+
+                                engine_free(&e, o.ptr, o.nbytes);
+                                ops++;
+                        }
+
+                        for (unsigned r = 0; r < cfg->rate; r++) {
+                                struct object o;
+
+                                o.nbytes = (size_t)dist_draw(&phases[p].size, &seed);
+                                o.death = tick + 1 + (unsigned long)dist_draw(&phases[p].lifetime, &seed);
+                                o.ptr = engine_alloc(&e, o.nbytes);
+                                ops++;
+
+                                if (o.ptr == NULL) {
+                                        failures++;
+                                        continue;
+                                }
+
+                                /* touch the object like a program would */
+                                memset(o.ptr, 0, (o.nbytes < 64) ? o.nbytes : 64);
+                                live_push(&live, o);
+                        }
+
+                        if ((tick + 1) % cfg->sample == 0) {
+                                const double t1 = now();
+                                const size_t foot = engine_footprint(&e, live.bytes);
+                                const double frag = foot ? 1.0 - (double)live.bytes / foot : 0;
+
+                                pthread_mutex_lock(&out_lock);
+                                printf("%s,%d,%s,%lu,%zu,%zu,%zu,%.4f,%zu,%.0f,%lu\n",
+                                       cfg->engine, w->id, phases[p].name, tick + 1, live.len,
+                                       live.bytes, foot, frag, rss_bytes(), ops / (t1 - t0), failures);
+                                fflush(stdout);
+                                pthread_mutex_unlock(&out_lock);
+
+                                ops = 0;
+                                t0 = t1;
+                        }
+                }
+        }
+
+        while (live.len > 0) {
+                struct object o = live_pop(&live);
+
+                engine_free(&e, o.ptr, o.nbytes);
+        }
+
+        free(live.objs);
+        engine_term(&e);
+
+        return NULL;
+}
+
+int main(int argc, char **argv)
+{
+        struct config cfg = { "buddy", 1, 100000, 10000, 16, 1 };
+        int opt;
+
+        while ((opt = getopt(argc, argv, "e:t:n:s:r:S:")) != -1) {
+                switch (opt) {
+                case 'e': cfg.engine = optarg; break;
+                case 't': cfg.threads = atoi(optarg); break;
+                case 'n': cfg.ticks = strtoul(optarg, NULL, 10); break;
+                case 's': cfg.sample = strtoul(optarg, NULL, 10); break;
+                case 'r': cfg.rate = (unsigned)atoi(optarg); break;
+                case 'S': cfg.seed = (unsigned)atoi(optarg); break;
+                default:
+                        fprintf(stderr, "usage: %s [-e engine] [-t threads] [-n ticks] [-s sample] [-r rate] [-S seed]\n", argv[0]);
+                        return 1;
+                }
+        }
+
+        if (cfg.threads < 1 || cfg.sample == 0)
+                return 1;
+
+        struct worker *workers = calloc(cfg.threads, sizeof(struct worker));
+
+        printf("engine,thread,phase,tick,objects,live_bytes,footprint,fragmentation,rss,ops_per_s,failures\n");
+
+        for (int i = 0; i < cfg.threads; i++) {
+                workers[i].id = i;
+                workers[i].cfg = &cfg;
+                pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+        }
+
+        for (int i = 0; i < cfg.threads; i++)
+                pthread_join(workers[i].thread, NULL);
+
+        free(workers);
+
+        return 0;
+}
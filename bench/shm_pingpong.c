@@ -0,0 +1,141 @@
+/* shm_pingpong.c -- messages passed through a shared block pool against a pipe
+ *
+ * A parent process sends messages to a forked child. With the pool, the parent writes
+ * each message in a block and sends its index, the child reads it in place and gives the
+ * block back. With the pipe, every message is copied in and out of the kernel.
+ *
+ * build: cc -O2 -I.. shm_pingpong.c -o shm_pingpong
+ */
+
+#include <time.h>
+#include <sched.h>
+#include <sys/wait.h>
+
+#include "shm_block.h"
+
+#define MESSAGES        2000000
+#define MSG_SIZE        256
+
+static double now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double run_pool(void)
+{
+        struct shm_block_pool p;
+
+        if (shm_block_create(&p, "shm_pingpong", MSG_SIZE, 4096, 2) != 0)
+                return 0;
+
+        const double t0 = now();
+        const pid_t pid = fork();
+
+        if (pid == 0) {
+                uint64_t sum = 0;
+
+                for (uint64_t n = 0; n < MESSAGES;) {
+                        const uint32_t index = shm_block_recv(&p, 1, 0);
+
+                        if (index == SHM_NIL) {
+                                sched_yield();
+                                continue;
+                        }
+
+                        const uint64_t *msg = shm_block_ptr(&p, index);
+
+                        sum += msg[0] + msg[MSG_SIZE / 8 - 1];
+                        shm_block_release(&p, 1, 0, index);
+                        n++;
+                }
+
+                _exit(sum == 2 * ((uint64_t)MESSAGES * (MESSAGES - 1) / 2) ? 0 : 1);
+        }
+
+        for (uint64_t n = 0; n < MESSAGES;) {
+                const uint32_t index = shm_block_alloc(&p, 0);
+
+                if (index == SHM_NIL) {
+                        sched_yield();
+                        continue;
+                }
+
+                uint64_t *msg = shm_block_ptr(&p, index);
+
+                memset(msg, 0, MSG_SIZE);
+                msg[0] = n;
+                msg[MSG_SIZE / 8 - 1] = n;
+
+                while (shm_block_send(&p, 0, 1, index) != 0)
+                        sched_yield();
+                n++;
+        }
+
+        int status;
+
+        waitpid(pid, &status, 0);
+        shm_block_detach(&p);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                fprintf(stderr, "shm_pingpong: messages corrupted\n");
+
+        return now() - t0;
+}
+
+static double run_pipe(void)
+{
+        int fds[2];
+        uint64_t msg[MSG_SIZE / 8];
+
+        if (pipe(fds) != 0)
+                return 0;
+
+        const double t0 = now();
+        const pid_t pid = fork();
+
+        if (pid == 0) {
+                close(fds[1]);
+
+                for (uint64_t n = 0; n < MESSAGES; n++) {
+                        for (size_t off = 0; off < MSG_SIZE;) {
+                                const ssize_t r = read(fds[0], (char *)msg + off, MSG_SIZE - off);
+
+                                if (r <= 0)
+                                        _exit(1);
+                                off += r;
+                        }
+                }
+
+                _exit(0);
+        }
+
+        close(fds[0]);
+
+        for (uint64_t n = 0; n < MESSAGES; n++) {
+                memset(msg, 0, MSG_SIZE);
+                msg[0] = n;
+
+                if (write(fds[1], msg, MSG_SIZE) != MSG_SIZE)
+                        break;
+        }
+
+        close(fds[1]);
+        waitpid(pid, NULL, 0);
+
+        return now() - t0;
+}
+
+int main(void)
+{
+        const double pool = run_pool();
+        const double pipe = run_pipe();
+
+        printf("shm_block: %.2f M msg/s\n", MESSAGES / pool / 1e6);
+        printf("pipe:      %.2f M msg/s\n", MESSAGES / pipe / 1e6);
+
+        return 0;
+}
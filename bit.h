@@ -3,7 +3,10 @@
 #ifndef BIT_H
 #define BIT_H
 
+#include <stdint.h>
+
 #define bit(A)                  (1 << (A))
+#define bit64(A)                (1ULL << (A))
 
 /* macros to manipulate bits in a 32-bit datatype */
 #define bit_set(A,B)            (A[(B/32)] |= 1 << (B%32))
@@ -11,6 +14,11 @@
 #define bit_check(A,B)          (A[(B/32)] & (1 << (B%32)))
 #define bit_switch(A, B)        bit_check(A, B) ? bit_clear(A, B) : bit_set(A, B)
 
+/* macros to manipulate bits in a 64-bit datatype */
+#define bit64_set(A,B)          (A[((B)/64)] |= bit64((B)%64))
+#define bit64_clear(A,B)        (A[((B)/64)] &= ~bit64((B)%64))
+#define bit64_check(A,B)        (A[((B)/64)] & bit64((B)%64))
+
 
 /* count the consecutive zero bits in a 32 bits datatype
  * see: https://graphics.stanford.edu/~seander/bithacks.html#ZerosOnRightMultLookup */
@@ -26,6 +34,40 @@ const uint8_t trailing_zeros_count(const uint32_t a)
         return bit_position_lookup[((uint32_t)((a & -a) * 0x077CB531U)) >> 27];
 }
 
+/* count the consecutive zero bits in a 64 bits datatype. a must not be 0 */
+uint8_t trailing_zeros_count64(const uint64_t a)
+{
+#if defined(__GNUC__)
+        return (uint8_t)__builtin_ctzll(a);
+#else
+        /* see https://www.chessprogramming.org/BitScan#De_Bruijn_Multiplication */
+        static const uint8_t bit_position_lookup[64] =
+        {
+                0, 1, 48, 2, 57, 49, 28, 3, 61, 58, 50, 42, 38, 29, 17, 4,
+                62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+                63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+                46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9, 13, 8, 7, 6
+        };
+
+        return bit_position_lookup[((a & -a) * 0x03f79d71b4cb0a89ULL) >> 58];
+#endif
+}
+
+/* round up to the next highest power of 2 of a 64-bit integer */
+uint64_t pow2_roundup64(uint64_t a)
+{
+        a--;
+        a |= a >> 1;
+        a |= a >> 2;
+        a |= a >> 4;
+        a |= a >> 8;
+        a |= a >> 16;
+        a |= a >> 32;
+        a++;
+
+        return a;
+}
+
 /* round up to the next highest power of 2 of a 32-bit integer */
 const unsigned pow2_roundup(unsigned a)
 {
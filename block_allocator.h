@@ -53,8 +53,25 @@ int block_heap_init(struct block_heap *b, struct heap *h, size_t nbytes, size_t
         b->first_free_block = 0;
         b->block_size = nbytes; 
         b->data = heap_aligned_alloc(h, nbytes * BLOCK_HEAP_MAX, alignment);
+
+        if (b->data == NULL)
+                return -1;
  
         block_heap_reset(b->data, nbytes, BLOCK_HEAP_MAX);
+
+        return 0;
+}
+
+/* same as block_heap_init() over caller-provided memory of at least
+ * nbytes * BLOCK_HEAP_MAX bytes. block_heap_term() must not be called on such a pool. */
+void block_heap_init_mem(struct block_heap *b, void *mem, size_t nbytes)
+{
+        b->nblocks = BLOCK_HEAP_MAX;
+        b->first_free_block = 0;
+        b->block_size = nbytes;
+        b->data = mem;
+
+        block_heap_reset(b->data, nbytes, BLOCK_HEAP_MAX);
 }
 
 void *block_alloc(struct block_heap *a)
@@ -70,12 +87,72 @@ void *block_alloc(struct block_heap *a)
         return ptr;
 }
 
+/* allocate the free block closest to hint: same cache line, else same page, else same
+ * huge page, else the nearest one. */
+void *block_alloc_near(struct block_heap *a, const void *hint)
+{
+        if (a->nblocks == 0)
+                return NULL;
+
+        const uintptr_t head = (uintptr_t)a->data;
+        uint8_t *prev = NULL, *best_prev = NULL;
+        int index = a->first_free_block;
+        int best = -1;
+        unsigned best_rank = UINT_MAX;
+        size_t best_dist = SIZE_MAX;
+
+        /* walk the free list, which holds the index of the next free block in the first
+         * byte of each free block */
+        for (int n = 0; n < a->nblocks; n++) {
+                uint8_t *ptr = (uint8_t *)(head + (a->block_size * index));
+                const unsigned rank = heap_locality(ptr, hint);
+                const size_t dist = heap_distance(ptr, hint);
+
+                if (rank < best_rank || (rank == best_rank && dist < best_dist)) {
+                        best = index;
+                        best_prev = prev;
+                        best_rank = rank;
+                        best_dist = dist;
+                }
+
+                prev = ptr;
+                index = *ptr;
+        }
+
+        if (best_prev == NULL)
+                return block_alloc(a);
+
+        uint8_t *ptr = (uint8_t *)(head + (a->block_size * best));
+
+        *best_prev = *ptr;
+        a->nblocks--;
+
+        return ptr;
+}
+
+/* index of the block at offset of the pool, -1 if offset is not the start of a block.
+ * power-of-2 block sizes (slab classes) avoid the division */
+int block_offset_index(uintptr_t offset, size_t block_size)
+{
+        if ((block_size & (block_size - 1)) == 0) {
+                if ((offset & (block_size - 1)) != 0)
+                        return -1;
+
+                return (int)(offset >> __builtin_ctzl(block_size));
+        }
+
+        if (offset % block_size != 0)
+                return -1;
+
+        return (int)(offset / block_size);
+}
+
 int block_is_valid(void *ptr, void *head, int nblocks, size_t block_size) 
 {
         void *tail = (void *)((uintptr_t)head + (BLOCK_HEAP_MAX * block_size));
         uintptr_t offset = (uintptr_t)ptr - (uintptr_t)head;
         
-        return (ptr >= head && ptr < tail && ((offset % block_size) == 0)) ? 1 : 0;
+        return (ptr >= head && ptr < tail && block_offset_index(offset, block_size) != -1) ? 1 : 0;
 }
 
 void block_free(struct block_heap *al, void *ptr) 
@@ -88,7 +165,7 @@ void block_free(struct block_heap *al, void *ptr)
                 return;
         }
         
-        uint8_t index = (uint8_t)((uintptr_t)(ptr - al->data) / al->block_size);
+        uint8_t index = (uint8_t)block_offset_index((uintptr_t)(ptr - al->data), al->block_size);
         
         *(uint8_t *)ptr = al->first_free_block;
         al->first_free_block = index;
@@ -32,6 +32,7 @@
 #include "list.h"
 
 #define META_ALIGNMENT 32
+#define BUDDY_NEAR_SCAN 64
 
 enum buddy_order : uint8_t {
         BUDDY_MAX_K = 28,
@@ -111,7 +112,8 @@ int buddy_heap_init(struct buddy_heap *bdy, struct heap *heap, uint8_t k, size_t
         }
          
         const int nbits = bit(k - BUDDY_MIN_K);
-        size_t meta_sz = (size_t)(((nbits + CHAR_BIT - 1) & -CHAR_BIT) / CHAR_BIT);
+        /* the bitset is accessed by 32 bit words (see bit.h) */
+        size_t meta_sz = (size_t)((nbits + 31) / 32) * sizeof(uint32_t);
        
         bdy->h = heap;
         bdy->k = k;
@@ -121,6 +123,9 @@ int buddy_heap_init(struct buddy_heap *bdy, struct heap *heap, uint8_t k, size_t
         if (bdy->bits == NULL) 
                 return -1;
 
+        memset(bdy->bits, 0, meta_sz);
+        memset(bdy->nodes, 0, sizeof(bdy->nodes));
+
         bdy->data = heap_aligned_alloc(heap, bit(k), alignment);
         
         if (bdy->data == NULL)
@@ -142,7 +147,12 @@ void buddy_heap_term(struct buddy_heap *bdy, struct heap *hp)
 
 uint8_t buddy_nbytes_query_to_index(const size_t nbytes, const enum buddy_order k)
 {
-        const size_t ceil = ((nbytes & (nbytes - 1)) != 0) ? pow2_roundup(nbytes) : nbytes; 
+        size_t ceil = ((nbytes & (nbytes - 1)) != 0) ? pow2_roundup(nbytes) : nbytes; 
+
+        /* the bitset has no bits for blocks below the minimum order */
+        if (ceil < bit(BUDDY_MIN_K))
+                ceil = bit(BUDDY_MIN_K);
+
         return (k - trailing_zeros_count(ceil));  
 }
 
@@ -226,6 +236,10 @@ void *buddy_alloc(struct buddy_heap *b, size_t nbytes)
                 return NULL;
 
         const size_t offset = (b->alignment - 1) + sizeof(struct buddy_block_prefix);
+
+        if (nbytes > bit(b->k) - offset)
+                return NULL;
+
         const uint8_t index = buddy_nbytes_query_to_index(nbytes + offset, b->k);
 
         if (b->nodes[index].head == NULL) 
@@ -237,6 +251,12 @@ void *buddy_alloc(struct buddy_heap *b, size_t nbytes)
                 buddy_block_reserve(b, index, &res); 
         }
 
+        if (b->nodes[index].head == NULL) {
+                if (b->h->hft & HEAP_DEBUG)
+                        printf("buddy_heap info: no free block of order %d\n", index);
+                return NULL;
+        }
+
         ptr_0 = b->nodes[index].head;
         buddy_node_update(index, b->k, b->nodes, ptr_0, res);
         buddy_bit_update(index, b->k, b->bits, b->data, ptr_0);
@@ -249,6 +269,188 @@ void *buddy_alloc(struct buddy_heap *b, size_t nbytes)
         return ptr_1; 
 }
 
+/* free block of list closest to hint and its locality (see heap_locality()). at most
+ * BUDDY_NEAR_SCAN blocks are examined. a block containing hint is the best choice. */
+struct list_node *buddy_node_near(struct list *node, size_t size, const void *hint, unsigned *rank)
+{
+        struct list_node *best = NULL;
+        size_t best_dist = SIZE_MAX;
+        int n = 0;
+
+        *rank = UINT_MAX;
+
+        for (struct list_node *ptr = node->head; ptr != NULL && n < BUDDY_NEAR_SCAN; ptr = ptr->next, n++) {
+                const uintptr_t lo = (uintptr_t)ptr;
+                const uintptr_t hi = lo + size - 1;
+                uintptr_t p = (uintptr_t)hint;
+
+                p = (p < lo) ? lo : (p > hi) ? hi : p;
+
+                const unsigned r = heap_locality((void *)p, hint);
+                const size_t dist = heap_distance((void *)p, hint);
+
+                if (r < *rank || (r == *rank && dist < best_dist)) {
+                        best = ptr;
+                        best_dist = dist;
+                        *rank = r;
+                }
+
+                if (dist == 0)
+                        break;
+        }
+
+        return best;
+}
+
+void buddy_node_near_front(struct list *node, size_t size, const void *hint)
+{
+        unsigned rank;
+        struct list_node *best = buddy_node_near(node, size, hint, &rank);
+
+        if (best != NULL && best != node->head) {
+                list_delete(&node->head, best);
+                list_push(&node->head, best);
+        }
+}
+
+/* same as buddy_alloc() but prefers the free block closest to hint. a larger block is
+ * split instead of the smallest splittable one only if it is strictly closer to hint,
+ * and the free list of each order split on the way is reordered so that the split
+ * happens near hint. */
+void *buddy_alloc_near(struct buddy_heap *b, size_t nbytes, const void *hint)
+{
+        if (nbytes == 0)
+                return NULL;
+
+        const size_t offset = (b->alignment - 1) + sizeof(struct buddy_block_prefix);
+
+        if (nbytes > bit(b->k) - offset)
+                return NULL;
+
+        const uint8_t index = buddy_nbytes_query_to_index(nbytes + offset, b->k);
+        int8_t node_index = index;
+        unsigned best_rank, rank;
+
+        if (b->nodes[index].head == NULL) {
+                node_index = buddy_first_splittable_node_index(index, b->nodes);
+
+                if (node_index == -1)
+                        return NULL;
+        }
+
+        buddy_node_near(&b->nodes[node_index], bit(b->k - node_index), hint, &best_rank);
+
+        for (int i = node_index - 1; i >= 0 && best_rank > 0; i--) {
+                if (b->nodes[i].head == NULL)
+                        continue;
+
+                buddy_node_near(&b->nodes[i], bit(b->k - i), hint, &rank);
+
+                if (rank < best_rank) {
+                        best_rank = rank;
+                        node_index = i;
+                }
+        }
+
+        for (int i = node_index; i < index; i++) {
+                buddy_node_near_front(&b->nodes[i], bit(b->k - i), hint);
+
+                void *ptr = (void *)b->nodes[i].head;
+                buddy_node_update(i, b->k, b->nodes, ptr, BUDDY_SPLIT);
+                buddy_bit_update(i, b->k, b->bits, b->data, ptr);
+        }
+
+        buddy_node_near_front(&b->nodes[index], bit(b->k - index), hint);
+
+        return buddy_alloc(b, nbytes);
+}
+
+/* move the lowest (high == 0) or highest addressed block among the first
+ * BUDDY_NEAR_SCAN blocks of list to its front, and return it */
+struct list_node *buddy_node_side_front(struct list *node, int high)
+{
+        struct list_node *best = node->head;
+        int n = 0;
+
+        for (struct list_node *ptr = node->head; ptr != NULL && n < BUDDY_NEAR_SCAN; ptr = ptr->next, n++) {
+                if (high ? ptr > best : ptr < best)
+                        best = ptr;
+        }
+
+        if (best != NULL && best != node->head) {
+                list_delete(&node->head, best);
+                list_push(&node->head, best);
+        }
+
+        return best;
+}
+
+/* same as buddy_alloc() but takes the block from the lowest (high == 0) or highest
+ * addresses of the arena: the free block of a sufficient order nearest to that end is
+ * split, keeping the half on that side at each order */
+void *buddy_alloc_side(struct buddy_heap *b, size_t nbytes, int high)
+{
+        if (nbytes == 0)
+                return NULL;
+
+        const size_t offset = (b->alignment - 1) + sizeof(struct buddy_block_prefix);
+
+        if (nbytes > bit(b->k) - offset)
+                return NULL;
+
+        const uint8_t index = buddy_nbytes_query_to_index(nbytes + offset, b->k);
+        uintptr_t best = high ? 0 : UINTPTR_MAX;
+        int node_index = -1;
+
+        /* from the required order to the largest blocks, an equal end keeps the smaller */
+        for (int i = index; i >= 0; i--) {
+                struct list_node *n = buddy_node_side_front(&b->nodes[i], high);
+
+                if (n == NULL)
+                        continue;
+
+                const uintptr_t at = high ? (uintptr_t)n + bit(b->k - i) : (uintptr_t)n;
+
+                if (high ? at > best : at < best) {
+                        best = at;
+                        node_index = i;
+                }
+        }
+
+        if (node_index == -1)
+                return NULL;
+
+        for (int i = node_index; i < index; i++) {
+                void *ptr = (void *)b->nodes[i].head;
+
+                buddy_node_update(i, b->k, b->nodes, ptr, BUDDY_SPLIT);
+                buddy_bit_update(i, b->k, b->bits, b->data, ptr);
+                buddy_node_side_front(&b->nodes[i + 1], high);
+        }
+
+        return buddy_alloc(b, nbytes);
+}
+
+/* buddy_alloc() with per allocation flags (see enum alloc_flag). hot blocks are taken
+ * from the low end of the arena and cold blocks from the high end, so that each kind
+ * gathers in its own pages */
+void *buddy_alloc_flags(struct buddy_heap *b, size_t nbytes, const unsigned flags)
+{
+        void *ptr;
+
+        if (nbytes == 0)
+                return NULL;
+
+        const size_t n = nbytes + alloc_vtail_size(flags);
+
+        if (flags & (ALLOC_HOT | ALLOC_COLD))
+                ptr = buddy_alloc_side(b, n, (flags & ALLOC_COLD) != 0);
+        else
+                ptr = buddy_alloc(b, n);
+
+        return alloc_vtail_clear(ptr, nbytes, flags);
+}
+
 void buddy_free(struct buddy_heap *b, void *ptr) 
 {
         if(ptr == NULL)
@@ -288,7 +490,9 @@ void buddy_free(struct buddy_heap *b, void *ptr)
 
                 buddy_free(b, ptr_1);
 
+                /* the merged block is on the list of order k - 1, not k */
                 bit_switch(bitset, bit_index);
+                return;
         }
         
         if (b->h->hft & HEAP_DEBUG) {
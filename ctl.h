@@ -0,0 +1,561 @@
+/* ctl.h -- String keyed control interface to live allocator instances
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef CTL_H
+#define CTL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "heap.h"
+#include "buddy_allocator.h"
+#include "block_allocator.h"
+#include "scratch_allocator.h"
+#include "slab_allocator.h"
+#include "extent_allocator.h"
+#include "large_allocator.h"
+#include "hugepage_filler.h"
+#include "thread_cache.h"
+
+enum ctl_limits {
+        CTL_MAX_INSTANCES = 64,
+        CTL_MAX_TOKENS = 8,
+        CTL_MAX_KEY = 128
+};
+
+enum ctl_kind : unsigned {
+        CTL_HEAP,
+        CTL_BUDDY,
+        CTL_BLOCK,
+        CTL_SCRATCH,
+        CTL_SLAB,
+        CTL_EXTENT,
+        CTL_LARGE,
+        CTL_HP_FILLER,
+        CTL_TCACHE,
+        CTL_NKINDS
+};
+
+#define CTL_ENV "ALLOC_CONF"
+
+/* Design of the system (after jemalloc's mallctl):
+ *      Allocator instances are registered under their kind and get an index, counted
+ *      per kind in order of registration. A key names a value of an instance:
+ *
+ *              <kind>.<index>.<name>[.<sub index>.<name>]
+ *
+ *              buddy.0.order.12.free   free blocks of 2^12 bytes of the first buddy heap
+ *              slab.1.limit            memory cap of the second slab heap
+ *              large.0.decay_ms        decommit delay of the first large cache
+ *
+ *      ctl() reads the value of a key into *oldp and/or writes *newp to it; read only
+ *      keys refuse a write. Every value is an unsigned 64 bit integer.
+ *      At registration, the settings of the ALLOC_CONF environment variable which name
+ *      the new instance are applied to it. ALLOC_CONF is a comma separated list of
+ *      key:value pairs; an index of * applies to every instance of the kind:
+ *
+ *              ALLOC_CONF="large.*.decay_ms:2000,slab.0.limit:67108864"
+ *
+ *      A setting which does not apply (unknown name, read only key, missing or malformed
+ *      value) is skipped and counted in ctl_reg.conf_errors; nothing is printed.
+ *
+ *      heap.N      alloc_count (with HEAP_COUNT)
+ *      buddy.N     k, free_bytes, order.K.free
+ *      block.N     block_size, nblocks, free_blocks
+ *      scratch.N   chunks, used, capacity (of a scratch chain)
+ *      slab.N      limit (rw), nbytes, class.C.{block_size, nslabs, allocs, failures,
+ *                  evictions, free_blocks}
+ *      extent.N    npages, free_pages
+ *      large.N     decay_ms (rw), max_retained (rw), retained, mapped
+ *      hp_filler.N nhugepages, used_pages
+ *      tcache.N    cap (rw), cached, ncaches, rebalances, class.C.{block_size, cached_blocks,
+ *                  max_blocks, refills, flushes} (summed over the thread caches while
+ *                  they run: approximate. refills and flushes include the caches
+ *                  already terminated)
+ *
+ *      The registry is not thread safe: instances are registered and tuned by one thread,
+ *      usually at startup. Counters are read with relaxed atomic loads and may be read
+ *      from any thread; the statistics which walk a list (buddy free_bytes and order.K,
+ *      scratch, slab free_blocks) must be read by the thread which uses the instance.
+ */
+
+struct ctl_entry {
+        enum ctl_kind           kind;
+        unsigned                index;
+        void                    *obj;
+};
+
+struct ctl_registry {
+        struct ctl_entry        entries[CTL_MAX_INSTANCES];
+        unsigned                nentries;
+        unsigned                counts[CTL_NKINDS];
+        unsigned                conf_errors;
+};
+
+struct ctl_registry ctl_reg;
+
+const char *ctl_kind_names[CTL_NKINDS] = {
+        [CTL_HEAP] = "heap",
+        [CTL_BUDDY] = "buddy",
+        [CTL_BLOCK] = "block",
+        [CTL_SCRATCH] = "scratch",
+        [CTL_SLAB] = "slab",
+        [CTL_EXTENT] = "extent",
+        [CTL_LARGE] = "large",
+        [CTL_HP_FILLER] = "hp_filler",
+        [CTL_TCACHE] = "tcache"
+};
+
+typedef int (*ctl_fn)(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp);
+
+/* the counters are read while other threads may update them: a relaxed load gets a
+ * value which was current at some point, never a torn one */
+#define ctl_load(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* read only value */
+int ctl_ro(uint64_t v, uint64_t *oldp, const uint64_t *newp)
+{
+        if (newp != NULL)
+                return -1;
+        if (oldp != NULL)
+                *oldp = v;
+
+        return 0;
+}
+
+int ctl_index(const char *tok, unsigned *index)
+{
+        char *end;
+        const unsigned long v = strtoul(tok, &end, 10);
+
+        if (*tok == '\0' || *end != '\0')
+                return -1;
+
+        *index = (unsigned)v;
+
+        return 0;
+}
+
+int ctl_heap(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct heap *h = obj;
+
+        if (ntok == 1 && strcmp(tok[0], "alloc_count") == 0)
+                return ctl_ro(ctl_load(h->alloc_count), oldp, newp);
+
+        return -1;
+}
+
+int ctl_buddy(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct buddy_heap *b = obj;
+
+        if (ntok == 1 && strcmp(tok[0], "k") == 0)
+                return ctl_ro(b->k, oldp, newp);
+
+        if (ntok == 1 && strcmp(tok[0], "free_bytes") == 0) {
+                uint64_t n = 0;
+
+                for (unsigned i = 0; i + BUDDY_MIN_K <= b->k; i++) {
+                        for (struct list_node *p = b->nodes[i].head; p != NULL; p = p->next)
+                                n += bit64(b->k - i);
+                }
+
+                return ctl_ro(n, oldp, newp);
+        }
+
+        /* order.K.free: K is the log2 of the block size */
+        if (ntok == 3 && strcmp(tok[0], "order") == 0 && strcmp(tok[2], "free") == 0) {
+                unsigned order;
+                uint64_t n = 0;
+
+                if (ctl_index(tok[1], &order) != 0 || order < BUDDY_MIN_K || order > b->k)
+                        return -1;
+
+                for (struct list_node *p = b->nodes[b->k - order].head; p != NULL; p = p->next)
+                        n++;
+
+                return ctl_ro(n, oldp, newp);
+        }
+
+        return -1;
+}
+
+int ctl_block(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct block_heap *b = obj;
+
+        if (ntok == 1 && strcmp(tok[0], "block_size") == 0)
+                return ctl_ro(ctl_load(b->block_size), oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "nblocks") == 0)
+                return ctl_ro(BLOCK_HEAP_MAX, oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "free_blocks") == 0)
+                return ctl_ro(ctl_load(b->nblocks), oldp, newp);
+
+        return -1;
+}
+
+int ctl_scratch(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct scratch_chain *chn = obj;
+        uint64_t chunks = 0, used = 0, capacity = 0;
+
+        for (struct scratch_chunk *c = chn->chunks; c != NULL; c = c->next) {
+                chunks++;
+                used += (uintptr_t)c->scr.head - (uintptr_t)c->scr.mem;
+                capacity += (uintptr_t)c->scr.tail - (uintptr_t)c->scr.mem;
+        }
+
+        if (ntok == 1 && strcmp(tok[0], "chunks") == 0)
+                return ctl_ro(chunks, oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "used") == 0)
+                return ctl_ro(used, oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "capacity") == 0)
+                return ctl_ro(capacity, oldp, newp);
+
+        return -1;
+}
+
+int ctl_slab(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct slab_heap *s = obj;
+
+        if (ntok == 1 && strcmp(tok[0], "limit") == 0) {
+                if (oldp != NULL)
+                        *oldp = ctl_load(s->limit);
+                if (newp != NULL)
+                        slab_heap_limit(s, (size_t)*newp);
+                return 0;
+        }
+
+        if (ntok == 1 && strcmp(tok[0], "nbytes") == 0)
+                return ctl_ro(ctl_load(s->nbytes), oldp, newp);
+
+        if (ntok == 3 && strcmp(tok[0], "class") == 0) {
+                unsigned index;
+
+                if (ctl_index(tok[1], &index) != 0 || index >= SLAB_NCLASSES)
+                        return -1;
+
+                struct slab_class *c = &s->classes[index];
+
+                if (strcmp(tok[2], "block_size") == 0)
+                        return ctl_ro(ctl_load(c->block_size), oldp, newp);
+                if (strcmp(tok[2], "nslabs") == 0)
+                        return ctl_ro(ctl_load(c->nslabs), oldp, newp);
+                if (strcmp(tok[2], "allocs") == 0)
+                        return ctl_ro(ctl_load(c->allocs), oldp, newp);
+                if (strcmp(tok[2], "failures") == 0)
+                        return ctl_ro(ctl_load(c->failures), oldp, newp);
+                if (strcmp(tok[2], "evictions") == 0)
+                        return ctl_ro(ctl_load(c->evictions), oldp, newp);
+                if (strcmp(tok[2], "free_blocks") == 0)
+                        return ctl_ro(slab_class_free_blocks(c), oldp, newp);
+        }
+
+        return -1;
+}
+
+int ctl_extent(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct extent_heap *e = obj;
+
+        if (ntok == 1 && strcmp(tok[0], "npages") == 0)
+                return ctl_ro(ctl_load(e->npages), oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "free_pages") == 0)
+                return ctl_ro(ctl_load(e->free_pages), oldp, newp);
+
+        return -1;
+}
+
+int ctl_large(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct large_cache *lc = obj;
+
+        if (ntok != 1)
+                return -1;
+
+        if (strcmp(tok[0], "decay_ms") == 0) {
+                if (oldp != NULL)
+                        *oldp = ctl_load(lc->decay_ns) / 1000000ULL;
+                if (newp != NULL)
+                        lc->decay_ns = *newp * 1000000ULL;
+                return 0;
+        }
+
+        if (strcmp(tok[0], "max_retained") == 0) {
+                if (oldp != NULL)
+                        *oldp = ctl_load(lc->max_retained);
+                if (newp != NULL) {
+                        lc->max_retained = (size_t)*newp;
+                        if (lc->max_retained != 0)
+                                large_cache_shrink(lc, lc->max_retained);
+                }
+                return 0;
+        }
+
+        if (strcmp(tok[0], "retained") == 0)
+                return ctl_ro(ctl_load(lc->retained), oldp, newp);
+        if (strcmp(tok[0], "mapped") == 0)
+                return ctl_ro(ctl_load(lc->mapped), oldp, newp);
+
+        return -1;
+}
+
+int ctl_hp_filler(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct hp_filler *f = obj;
+
+        if (ntok == 1 && strcmp(tok[0], "nhugepages") == 0)
+                return ctl_ro(ctl_load(f->nhugepages), oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "used_pages") == 0)
+                return ctl_ro(ctl_load(f->used_pages), oldp, newp);
+
+        return -1;
+}
+
+int ctl_tcache(void *obj, char **tok, int ntok, uint64_t *oldp, const uint64_t *newp)
+{
+        struct tcache_pool *p = obj;
+
+        if (ntok == 1 && strcmp(tok[0], "cap") == 0) {
+                if (oldp != NULL)
+                        *oldp = ctl_load(p->cap);
+                if (newp != NULL)
+                        __atomic_store_n(&p->cap, (size_t)*newp, __ATOMIC_RELAXED);
+                return 0;
+        }
+
+        if (ntok == 1 && strcmp(tok[0], "cached") == 0)
+                return ctl_ro(ctl_load(p->cached), oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "ncaches") == 0)
+                return ctl_ro(ctl_load(p->ncaches), oldp, newp);
+        if (ntok == 1 && strcmp(tok[0], "rebalances") == 0)
+                return ctl_ro(ctl_load(p->rebalances), oldp, newp);
+
+        if (ntok == 3 && strcmp(tok[0], "class") == 0) {
+                unsigned index;
+                uint64_t n = 0;
+
+                if (ctl_index(tok[1], &index) != 0 || index >= TCACHE_NCLASSES)
+                        return -1;
+
+                if (strcmp(tok[2], "block_size") == 0)
+                        return ctl_ro(tcache_class_size(index), oldp, newp);
+
+                const char *leaves[] = { "cached_blocks", "max_blocks", "refills", "flushes" };
+                int f = 0;
+
+                while (f < 4 && strcmp(tok[2], leaves[f]) != 0)
+                        f++;
+
+                if (f == 4)
+                        return -1;
+
+                /* the caches are linked under the lock. their bins are updated by their
+                 * threads without it: the sum is approximate, each term is untorn */
+                tcache_pool_lock(p);
+
+                /* the refills and flushes of the terminated caches */
+                if (f == 2)
+                        n = p->refills[index];
+                else if (f == 3)
+                        n = p->flushes[index];
+
+                for (struct thread_cache *tc = p->caches; tc != NULL; tc = tc->next) {
+                        struct tcache_bin *bin = &tc->bins[index];
+
+                        n += (f == 0) ? ctl_load(bin->count) : (f == 1) ? ctl_load(bin->max) :
+                             (f == 2) ? ctl_load(bin->refills) : ctl_load(bin->flushes);
+                }
+
+                tcache_pool_unlock(p);
+
+                return ctl_ro(n, oldp, newp);
+        }
+
+        return -1;
+}
+
+ctl_fn ctl_fns[CTL_NKINDS] = {
+        [CTL_HEAP] = ctl_heap,
+        [CTL_BUDDY] = ctl_buddy,
+        [CTL_BLOCK] = ctl_block,
+        [CTL_SCRATCH] = ctl_scratch,
+        [CTL_SLAB] = ctl_slab,
+        [CTL_EXTENT] = ctl_extent,
+        [CTL_LARGE] = ctl_large,
+        [CTL_HP_FILLER] = ctl_hp_filler,
+        [CTL_TCACHE] = ctl_tcache
+};
+
+/* split key (copied to buf) on '.', returns the number of tokens or -1 */
+int ctl_split(const char *key, char *buf, char **tok)
+{
+        char *save;
+        int n = 0;
+
+        if (strlen(key) >= CTL_MAX_KEY)
+                return -1;
+
+        strcpy(buf, key);
+
+        for (char *p = strtok_r(buf, ".", &save); p != NULL; p = strtok_r(NULL, ".", &save)) {
+                if (n == CTL_MAX_TOKENS)
+                        return -1;
+                tok[n++] = p;
+        }
+
+        return n;
+}
+
+int ctl_kind_of(const char *name)
+{
+        for (unsigned i = 0; i < CTL_NKINDS; i++) {
+                if (strcmp(ctl_kind_names[i], name) == 0)
+                        return (int)i;
+        }
+
+        return -1;
+}
+
+struct ctl_entry *ctl_find(enum ctl_kind kind, unsigned index)
+{
+        for (unsigned i = 0; i < ctl_reg.nentries; i++) {
+                struct ctl_entry *e = &ctl_reg.entries[i];
+
+                if (e->kind == kind && e->index == index && e->obj != NULL)
+                        return e;
+        }
+
+        return NULL;
+}
+
+/* read the value of key into *oldp and/or write *newp to it. either may be NULL */
+int ctl(const char *key, uint64_t *oldp, const uint64_t *newp)
+{
+        char buf[CTL_MAX_KEY];
+        char *tok[CTL_MAX_TOKENS];
+        unsigned index;
+        const int n = ctl_split(key, buf, tok);
+
+        if (n < 3)
+                return -1;
+
+        const int kind = ctl_kind_of(tok[0]);
+
+        if (kind == -1 || ctl_index(tok[1], &index) != 0)
+                return -1;
+
+        struct ctl_entry *e = ctl_find(kind, index);
+
+        if (e == NULL)
+                return -1;
+
+        return ctl_fns[kind](e->obj, tok + 2, n - 2, oldp, newp);
+}
+
+/* apply the key:value pairs of conf which name instance e. returns the number of pairs
+ * which failed to apply */
+int ctl_conf_apply(const char *conf, struct ctl_entry *e)
+{
+        char buf[CTL_MAX_KEY];
+        char *tok[CTL_MAX_TOKENS];
+        int failed = 0;
+
+        while (conf != NULL && *conf != '\0') {
+                const char *end = strchr(conf, ',');
+                const size_t len = (end != NULL) ? (size_t)(end - conf) : strlen(conf);
+                const char *colon = memchr(conf, ':', len);
+
+                if (colon == NULL || (size_t)(colon - conf) >= CTL_MAX_KEY) {
+                        failed++;
+                        goto next;
+                }
+
+                char key[CTL_MAX_KEY];
+                char *vend;
+                unsigned index;
+
+                memcpy(key, conf, colon - conf);
+                key[colon - conf] = '\0';
+
+                const uint64_t v = strtoull(colon + 1, &vend, 0);
+                const int n = ctl_split(key, buf, tok);
+
+                if (n < 3 || ctl_kind_of(tok[0]) != (int)e->kind)
+                        goto next;
+                if (strcmp(tok[1], "*") != 0 && (ctl_index(tok[1], &index) != 0 || index != e->index))
+                        goto next;
+
+                /* the value must be a number, not empty nor followed by junk */
+                if (vend == colon + 1 || vend != conf + len || ctl_fns[e->kind](e->obj, tok + 2, n - 2, NULL, &v) != 0)
+                        failed++;
+next:
+                conf = (end != NULL) ? end + 1 : NULL;
+        }
+
+        return failed;
+}
+
+/* apply conf to every registered instance it names */
+int ctl_conf(const char *conf)
+{
+        int failed = 0;
+
+        for (unsigned i = 0; i < ctl_reg.nentries; i++) {
+                if (ctl_reg.entries[i].obj != NULL)
+                        failed += ctl_conf_apply(conf, &ctl_reg.entries[i]);
+        }
+
+        return failed;
+}
+
+/* register obj, an instance of kind, and apply ALLOC_CONF to it. returns its index.
+ * the settings which failed to apply are counted in ctl_reg.conf_errors */
+int ctl_register(enum ctl_kind kind, void *obj)
+{
+        if (obj == NULL || kind >= CTL_NKINDS || ctl_reg.nentries == CTL_MAX_INSTANCES)
+                return -1;
+
+        struct ctl_entry *e = &ctl_reg.entries[ctl_reg.nentries++];
+
+        e->kind = kind;
+        e->index = ctl_reg.counts[kind]++;
+        e->obj = obj;
+
+        ctl_reg.conf_errors += ctl_conf_apply(getenv(CTL_ENV), e);
+
+        return (int)e->index;
+}
+
+/* must be called before obj is terminated. the index is not reused */
+void ctl_unregister(void *obj)
+{
+        for (unsigned i = 0; i < ctl_reg.nentries; i++) {
+                if (ctl_reg.entries[i].obj == obj)
+                        ctl_reg.entries[i].obj = NULL;
+        }
+}
+
+#endif
@@ -0,0 +1,208 @@
+/* extent_allocator.h -- Implementation of an address-ordered best-fit page allocator
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef EXTENT_ALLOCATOR_H
+#define EXTENT_ALLOCATOR_H
+
+#include "heap.h"
+#include "tree.h"
+
+/* Design of the system:
+ *      The arena is a range of pages. Free pages form extents (maximal runs of free
+ *      pages); each free extent holds its own descriptor in its first page, linked in
+ *      two trees:
+ *              by_size: ordered by (number of pages, address), for best fit
+ *              by_addr: ordered by address, to find the neighbours of a freed run
+ *      An allocation of n pages takes the smallest extent of at least n pages, the
+ *      lowest addressed one among equals, and carves the n pages from its end so that
+ *      the remainder keeps its address (only its by_size position changes).
+ *      A deallocation merges the freed run with the free extents ending right before
+ *      and starting right after it. Any number of pages can be allocated, so the waste
+ *      of a power-of-2 allocator on odd sizes is avoided.
+ *
+ *      +------+-----------+--------+-------------+------+
+ *      | used | free (3)  |  used  |  free (12)  | used |
+ *      +------+-----------+--------+-------------+------+
+ *             ^ extent             ^ extent
+ *
+ *      Deallocation takes the number of pages of the allocation.
+ */
+
+struct extent {
+        struct tree_node        by_size;
+        struct tree_node        by_addr;
+        uintptr_t               base;
+        size_t                  npages;
+};
+
+struct extent_heap {
+        struct heap             *h;
+        void                    *mem;
+        size_t                  npages;
+        size_t                  free_pages;
+        struct tree             by_size;
+        struct tree             by_addr;
+};
+
+int extent_cmp_size(const struct tree_node *a, const struct tree_node *b)
+{
+        const struct extent *x = tree_entry(a, struct extent, by_size);
+        const struct extent *y = tree_entry(b, struct extent, by_size);
+
+        if (x->npages != y->npages)
+                return (x->npages < y->npages) ? -1 : 1;
+        if (x->base != y->base)
+                return (x->base < y->base) ? -1 : 1;
+
+        return 0;
+}
+
+int extent_cmp_addr(const struct tree_node *a, const struct tree_node *b)
+{
+        const struct extent *x = tree_entry(a, struct extent, by_addr);
+        const struct extent *y = tree_entry(b, struct extent, by_addr);
+
+        if (x->base != y->base)
+                return (x->base < y->base) ? -1 : 1;
+
+        return 0;
+}
+
+size_t extent_npages(size_t nbytes)
+{
+        return (nbytes + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+}
+
+struct extent *extent_make(struct extent_heap *e, void *ptr, size_t npages)
+{
+        struct extent *x = ptr;
+
+        x->base = (uintptr_t)ptr;
+        x->npages = npages;
+
+        tree_insert(&e->by_size, &x->by_size);
+        tree_insert(&e->by_addr, &x->by_addr);
+
+        return x;
+}
+
+int extent_heap_init(struct extent_heap *e, struct heap *h, size_t npages)
+{
+        if (npages == 0)
+                return -1;
+
+        e->h = h;
+        e->npages = npages;
+        e->free_pages = npages;
+        e->mem = heap_aligned_alloc(h, npages * HEAP_PAGE_SIZE, HEAP_PAGE_SIZE);
+
+        if (e->mem == NULL)
+                return -1;
+
+        tree_init(&e->by_size, extent_cmp_size);
+        tree_init(&e->by_addr, extent_cmp_addr);
+        extent_make(e, e->mem, npages);
+
+        return 0;
+}
+
+void extent_heap_term(struct extent_heap *e)
+{
+        if (e == NULL || e->mem == NULL)
+                return;
+
+        heap_aligned_free(e->h, e->mem);
+        e->mem = NULL;
+}
+
+void *extent_alloc(struct extent_heap *e, size_t npages)
+{
+        if (npages == 0)
+                return NULL;
+
+        struct extent key = { .base = 0, .npages = npages };
+        struct tree_node *n = tree_lower_bound(&e->by_size, &key.by_size);
+
+        if (n == NULL) {
+                if (e->h->hft & HEAP_DEBUG)
+                        printf("extent_heap info: no free extent of %zu pages\n", npages);
+                return NULL;
+        }
+
+        struct extent *x = tree_entry(n, struct extent, by_size);
+
+        tree_remove(&e->by_size, &x->by_size);
+        e->free_pages -= npages;
+
+        if (x->npages == npages) {
+                tree_remove(&e->by_addr, &x->by_addr);
+                return x;
+        }
+
+        /* carve from the end, the remainder stays at the same address */
+        x->npages -= npages;
+        tree_insert(&e->by_size, &x->by_size);
+
+        return (void *)(x->base + (x->npages * HEAP_PAGE_SIZE));
+}
+
+void extent_free(struct extent_heap *e, void *ptr, size_t npages)
+{
+        if (ptr == NULL || npages == 0)
+                return;
+
+        const uintptr_t base = (uintptr_t)ptr;
+        const uintptr_t end = base + (npages * HEAP_PAGE_SIZE);
+
+        if (base < (uintptr_t)e->mem || end > (uintptr_t)e->mem + (e->npages * HEAP_PAGE_SIZE)) {
+                if (e->h->hft & HEAP_DEBUG)
+                        printf("extent_heap info: @%p not owned by extent heap\n", ptr);
+                return;
+        }
+
+        struct extent key = { .base = base };
+        struct tree_node *p = tree_predecessor(&e->by_addr, &key.by_addr);
+        struct tree_node *s = tree_lower_bound(&e->by_addr, &key.by_addr);
+        struct extent *prev = (p != NULL) ? tree_entry(p, struct extent, by_addr) : NULL;
+        struct extent *next = (s != NULL) ? tree_entry(s, struct extent, by_addr) : NULL;
+
+        e->free_pages += npages;
+
+        if (next != NULL && next->base == end) {
+                tree_remove(&e->by_size, &next->by_size);
+                tree_remove(&e->by_addr, &next->by_addr);
+                npages += next->npages;
+        }
+
+        if (prev != NULL && prev->base + (prev->npages * HEAP_PAGE_SIZE) == base) {
+                /* prev keeps its address, only its size changes */
+                tree_remove(&e->by_size, &prev->by_size);
+                prev->npages += npages;
+                tree_insert(&e->by_size, &prev->by_size);
+                return;
+        }
+
+        extent_make(e, ptr, npages);
+}
+
+#endif
@@ -0,0 +1,345 @@
+/* frame_allocator.h -- Per-thread allocator for short-lived coroutine frames
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef FRAME_ALLOCATOR_H
+#define FRAME_ALLOCATOR_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "heap.h"
+#include "slab_allocator.h"
+#include "scratch_allocator.h"
+
+#define FRAME_ALIGNMENT 16
+
+enum frame_source : uint8_t {
+        FRAME_SLAB,
+        FRAME_SCRATCH,
+        FRAME_HEAP
+};
+
+/* Design of the system:
+ *      Each thread owns a frame pool made of a slab heap (size-classed block pools) and
+ *      an optional scratch arena bound by the caller for the duration of a request.
+ *      Frames are served from the bound arena if any, else from the slab heap, else
+ *      (frame larger than the largest slab class) from the heap.
+ *      Frames from an arena are not freed individually: they go away when the arena is
+ *      reset.
+ *
+ *      Each frame carries a prefix recording its source, slab and owning pool. A frame freed
+ *      by another thread (a coroutine resumed and destroyed elsewhere) is pushed on the
+ *      remote list of its owner, which is drained by the owner at its next allocation.
+ *
+ *      The frames freed by their owner are kept on a free list per slab class and reused
+ *      first, with their prefix; the slab heap itself is only used to grow the lists.
+ *
+ *      A pool outlives its thread while frames of it are alive. At thread exit (or
+ *      frame_pool_term()) the remote list is closed (FRAME_ORPHAN) and the pool counts
+ *      its live frames: frames freed afterwards are reclaimed under the lock of the pool
+ *      by the freeing thread, and the last one destroys the pool.
+ *
+ *      +----------------+--------------------------------------------------------+
+ *      |  Prefix (32)   | Frame                                                  |
+ *      +----------------+--------------------------------------------------------+
+ *                       |
+ *                       `-> address return to promise_type::operator new
+ *
+ *      Usage from a C++20 promise type (the header compiled in a C translation unit
+ *      exposing frame_alloc/frame_free with C linkage):
+ *
+ *      struct promise_type {
+ *              static void *operator new(size_t n) noexcept { return frame_alloc(n); }
+ *              static void operator delete(void *p) { frame_free(p); }
+ *              static task get_return_object_on_allocation_failure();
+ *              ...
+ *      };
+ *
+ *      Allocation is independent of how the coroutines are resumed, so symmetric
+ *      transfer (await_suspend returning a coroutine_handle) is unaffected.
+ */
+
+struct frame_pool;
+
+struct frame_prefix {
+        union {
+                struct frame_pool       *owner;
+                struct frame_prefix     *next;
+        };
+        struct slab                     *slab;
+        enum frame_source               src;
+        uint8_t                         cls;
+} __attribute__((aligned(FRAME_ALIGNMENT)));
+
+struct frame_pool {
+        struct heap             h;
+        struct slab_heap        slab;
+        struct scratch_heap     *scr;
+        struct frame_prefix     *remote;
+        struct frame_prefix     *cache[SLAB_NCLASSES];
+        size_t                  live;
+        size_t                  orphan_live;
+        char                    lock;
+};
+
+/* value of the remote list of a pool whose thread has gone */
+#define FRAME_ORPHAN ((struct frame_prefix *)1)
+
+_Thread_local struct frame_pool *frame_pool_tls;
+pthread_key_t frame_pool_key;
+pthread_once_t frame_pool_once = PTHREAD_ONCE_INIT;
+
+void frame_pool_release(struct frame_pool *fp);
+
+void frame_pool_exit(void *arg)
+{
+        frame_pool_release(arg);
+}
+
+void frame_pool_key_init(void)
+{
+        pthread_key_create(&frame_pool_key, frame_pool_exit);
+}
+
+/* the pool of the calling thread, NULL if out of memory. it is released when the
+ * thread exits */
+struct frame_pool *frame_pool_get(void)
+{
+        struct frame_pool *fp = frame_pool_tls;
+
+        if (fp != NULL)
+                return fp;
+
+        pthread_once(&frame_pool_once, frame_pool_key_init);
+
+        fp = malloc(sizeof(struct frame_pool));
+
+        if (fp == NULL)
+                return NULL;
+
+        heap_init(&fp->h, 0);
+        slab_heap_init(&fp->slab, &fp->h, FRAME_ALIGNMENT);
+        fp->scr = NULL;
+        fp->remote = NULL;
+        memset(fp->cache, 0, sizeof(fp->cache));
+        fp->live = 0;
+        fp->orphan_live = 0;
+        fp->lock = 0;
+
+        frame_pool_tls = fp;
+        pthread_setspecific(frame_pool_key, fp);
+
+        return fp;
+}
+
+/* bind a scratch arena to the calling thread. frames allocated until the next call are
+ * served from it. returns the previously bound arena. */
+struct scratch_heap *frame_pool_bind(struct scratch_heap *scr)
+{
+        struct frame_pool *fp = frame_pool_get();
+        struct scratch_heap *prev;
+
+        if (fp == NULL)
+                return NULL;
+
+        prev = fp->scr;
+        fp->scr = scr;
+
+        return prev;
+}
+
+void frame_reclaim(struct frame_pool *fp, struct frame_prefix *m)
+{
+        if (m->src == FRAME_SLAB)
+                block_free(&m->slab->blk, m);
+        else
+                heap_free(&fp->h, m);
+}
+
+void frame_pool_drain(struct frame_pool *fp)
+{
+        struct frame_prefix *m = __atomic_exchange_n(&fp->remote, NULL, __ATOMIC_ACQUIRE);
+
+        while (m != NULL) {
+                struct frame_prefix *next = m->next;
+
+                frame_reclaim(fp, m);
+                fp->live--;
+                m = next;
+        }
+}
+
+void frame_pool_destroy(struct frame_pool *fp)
+{
+        slab_heap_term(&fp->slab);
+        free(fp);
+}
+
+/* free a frame of a pool whose thread has gone. the last frame destroys the pool */
+void frame_orphan_free(struct frame_pool *fp, struct frame_prefix *m)
+{
+        heap_spin_lock(&fp->lock);
+        frame_reclaim(fp, m);
+        heap_spin_unlock(&fp->lock);
+
+        if (__atomic_sub_fetch(&fp->orphan_live, 1, __ATOMIC_ACQ_REL) == 0)
+                frame_pool_destroy(fp);
+}
+
+/* the thread of fp is done with it: the frames still alive keep the pool until they
+ * are freed (by any thread) */
+void frame_pool_release(struct frame_pool *fp)
+{
+        size_t n = 0;
+
+        /* one reference per live frame, and one held until the remote list is drained.
+         * published to the remote freers by the exchange below */
+        __atomic_store_n(&fp->orphan_live, fp->live + 1, __ATOMIC_RELAXED);
+
+        struct frame_prefix *m = __atomic_exchange_n(&fp->remote, FRAME_ORPHAN, __ATOMIC_ACQ_REL);
+
+        heap_spin_lock(&fp->lock);
+
+        while (m != NULL) {
+                struct frame_prefix *next = m->next;
+
+                frame_reclaim(fp, m);
+                n++;
+                m = next;
+        }
+
+        heap_spin_unlock(&fp->lock);
+
+        if (__atomic_sub_fetch(&fp->orphan_live, n + 1, __ATOMIC_ACQ_REL) == 0)
+                frame_pool_destroy(fp);
+}
+
+void *frame_alloc(size_t nbytes)
+{
+        struct frame_pool *fp = frame_pool_get();
+        struct frame_prefix *m = NULL;
+        const size_t total = nbytes + sizeof(struct frame_prefix);
+        enum frame_source src;
+        struct slab *slab = NULL;
+
+        if (fp == NULL)
+                return NULL;
+
+        if (__atomic_load_n(&fp->remote, __ATOMIC_RELAXED) != NULL)
+                frame_pool_drain(fp);
+
+        if (fp->scr != NULL) {
+                m = scratch_alloc(fp->scr, total, FRAME_ALIGNMENT);
+                src = FRAME_SCRATCH;
+        }
+
+        const int cls = slab_size_class(total);
+
+        /* frames freed by the owner are reused first, prefix included */
+        if (m == NULL && cls != -1 && fp->cache[cls] != NULL) {
+                m = fp->cache[cls];
+                fp->cache[cls] = m->next;
+                m->owner = fp;
+                fp->live++;
+
+                return m + 1;
+        }
+
+        if (m == NULL && cls != -1) {
+                struct slab_class *c = &fp->slab.classes[cls];
+                m = slab_class_alloc(c);
+                slab = c->slabs;
+                src = FRAME_SLAB;
+        }
+
+        if (m == NULL) {
+                m = heap_alloc(&fp->h, total);
+                src = FRAME_HEAP;
+        }
+
+        if (m == NULL)
+                return NULL;
+
+        if (src != FRAME_SCRATCH)
+                fp->live++;
+
+        m->owner = fp;
+        m->src = src;
+        m->slab = slab;
+        m->cls = (uint8_t)cls;
+
+        return m + 1;
+}
+
+void frame_free(void *ptr)
+{
+        if (ptr == NULL)
+                return;
+
+        struct frame_prefix *m = (struct frame_prefix *)ptr - 1;
+        struct frame_pool *owner = m->owner;
+
+        if (m->src == FRAME_SCRATCH)
+                return;
+
+        if (owner == frame_pool_tls) {
+                if (m->src == FRAME_SLAB) {
+                        m->next = owner->cache[m->cls];
+                        owner->cache[m->cls] = m;
+                } else {
+                        heap_free(&owner->h, m);
+                }
+
+                owner->live--;
+                return;
+        }
+
+        struct frame_prefix *head = __atomic_load_n(&owner->remote, __ATOMIC_ACQUIRE);
+
+        do {
+                if (head == FRAME_ORPHAN) {
+                        frame_orphan_free(owner, m);
+                        return;
+                }
+
+                m->next = head;
+        } while (!__atomic_compare_exchange_n(&owner->remote, &head, m, 1,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+/* release the calling thread's pool, as its exit does. the frames still alive stay
+ * valid, and the pool is destroyed with the last of them */
+void frame_pool_term(void)
+{
+        struct frame_pool *fp = frame_pool_tls;
+
+        if (fp == NULL)
+                return;
+
+        frame_pool_tls = NULL;
+        pthread_setspecific(frame_pool_key, NULL);
+        frame_pool_drain(fp);
+        frame_pool_release(fp);
+}
+
+#endif
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <sched.h>
 
 #include "bit.h"
 
@@ -23,6 +24,29 @@ enum heap_flag : unsigned {
 #define HEAP_CLEAR bit(H_CLEAR) 
 #define HEAP_DEBUG bit(H_DEBUG) 
 
+/* per allocation flags, accepted by the *_alloc_flags() functions */
+enum alloc_flag : unsigned {
+        A_VTAIL32,
+        A_VTAIL64,
+        A_HOT,
+        A_COLD
+};
+
+/* the region is readable and zero-filled up to the next 32 (64) byte boundary past its
+ * end, so that SIMD code can process the tail with full-width loads */
+#define ALLOC_VTAIL32 bit(A_VTAIL32)
+#define ALLOC_VTAIL64 bit(A_VTAIL64)
+
+/* temperature hints: hot objects are packed apart from the others, cold objects are
+ * placed where their pages can be given MADV_COLD or decommitted (see slab_heap_cold()) */
+#define ALLOC_HOT bit(A_HOT)
+#define ALLOC_COLD bit(A_COLD)
+
+/* granularities used by the *_alloc_near() locality hints */
+#define HEAP_LINE_SIZE          64
+#define HEAP_PAGE_SIZE          4096
+#define HEAP_HUGEPAGE_SIZE      (2 * 1024 * 1024)
+
 struct heap {
         enum heap_flag hft;
         unsigned alloc_count;
@@ -60,6 +84,34 @@ void *heap_alloc(struct heap *h, const size_t nbytes)
         return ptr;
 }
 
+/* padding added to an allocation for its vector tail. a full vector width covers both
+ * the next aligned boundary past the end and a last unaligned load from the start */
+size_t alloc_vtail_size(const unsigned flags)
+{
+        if (flags & ALLOC_VTAIL64)
+                return 64;
+        if (flags & ALLOC_VTAIL32)
+                return 32;
+
+        return 0;
+}
+
+void *alloc_vtail_clear(void *ptr, const size_t nbytes, const unsigned flags)
+{
+        if (ptr != NULL)
+                memset((char *)ptr + nbytes, 0, alloc_vtail_size(flags));
+
+        return ptr;
+}
+
+void *heap_alloc_flags(struct heap *h, const size_t nbytes, const unsigned flags)
+{
+        if (nbytes == 0)
+                return NULL;
+
+        return alloc_vtail_clear(heap_alloc(h, nbytes + alloc_vtail_size(flags)), nbytes, flags);
+}
+
 void *heap_aligned_alloc(struct heap *h, const size_t nbytes, const size_t alignment)
 {
         void *ptr_0, **ptr_1;
@@ -96,6 +148,29 @@ void *heap_aligned_alloc(struct heap *h, const size_t nbytes, const size_t align
         return ptr_1;
 }
 
+/* nbytes aligned on alignment (a power of 2, nbytes a multiple of it), released with
+ * heap_free(). unlike heap_aligned_alloc() the allocator gives the padding back, so large
+ * alignments (a slab aligned on its size) do not double the memory */
+void *heap_memalign(struct heap *h, const size_t nbytes, const size_t alignment)
+{
+        void *ptr = (nbytes != 0) ? aligned_alloc(alignment, nbytes) : NULL;
+
+        if (ptr == NULL) {
+                if (h->hft & HEAP_DEBUG)
+                        printf("heap info: could not allocate requested size\n");
+                return NULL;
+        }
+
+        if (h->hft & HEAP_COUNT)
+                h->alloc_count++;
+        if (h->hft & HEAP_CLEAR)
+                memset(ptr, 0, nbytes);
+        if (h->hft & HEAP_DEBUG)
+                printf("heap_memalign @%p size(%zu)\n", ptr, nbytes);
+
+        return ptr;
+}
+
 void heap_free(struct heap *h, void *ptr)
 {
         if (ptr == NULL) return;
@@ -118,6 +193,60 @@ void heap_aligned_free(struct heap *h, void *ptr)
         heap_free(h, ((void**)ptr)[-1]);
 }
 
+/* locality of two addresses: 0 same cache line, 1 same page, 2 same huge page, 3 none */
+unsigned heap_locality(const void *a, const void *b)
+{
+        const uintptr_t x = (uintptr_t)a ^ (uintptr_t)b;
+
+        if (x < HEAP_LINE_SIZE)
+                return 0;
+        if (x < HEAP_PAGE_SIZE)
+                return 1;
+        if (x < HEAP_HUGEPAGE_SIZE)
+                return 2;
+
+        return 3;
+}
+
+size_t heap_distance(const void *a, const void *b)
+{
+        return (a > b) ? (uintptr_t)a - (uintptr_t)b : (uintptr_t)b - (uintptr_t)a;
+}
+
+/* spin lock for the allocators shared between threads. waiters spin on a plain load,
+ * with a pause, and yield the core after HEAP_SPIN_MAX rounds */
+#define HEAP_SPIN_MAX 64
+
+void heap_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        __asm__ __volatile__("yield");
+#endif
+}
+
+void heap_spin_lock(char *lock)
+{
+        unsigned spins = 0;
+
+        while (__atomic_test_and_set(lock, __ATOMIC_ACQUIRE)) {
+                while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+                        if (++spins < HEAP_SPIN_MAX) {
+                                heap_cpu_relax();
+                        } else {
+                                sched_yield();
+                                spins = 0;
+                        }
+                }
+        }
+}
+
+void heap_spin_unlock(char *lock)
+{
+        __atomic_clear(lock, __ATOMIC_RELEASE);
+}
+
 void heap_term(struct heap *h) {
   
         if ((h->hft & HEAP_COUNT) && (h->hft & HEAP_DEBUG)) {
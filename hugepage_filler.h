@@ -0,0 +1,260 @@
+/* hugepage_filler.h -- Page provider packing allocations into 2 MiB huge pages
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef HUGEPAGE_FILLER_H
+#define HUGEPAGE_FILLER_H
+
+#include <sys/mman.h>
+
+#include "heap.h"
+#include "bit.h"
+
+enum hugepage_limits {
+        HUGEPAGE_NPAGES = HEAP_HUGEPAGE_SIZE / HEAP_PAGE_SIZE,
+        HUGEPAGE_NWORDS = HUGEPAGE_NPAGES / 64
+};
+
+/* Design of the system (after the huge page filler of TCMalloc's Temeraire):
+ *      Memory is mapped from the system one 2 MiB aligned huge page at a time, with
+ *      MADV_HUGEPAGE so that it is backed by a transparent huge page. Callers get runs
+ *      of 4 KiB pages carved from those huge pages.
+ *      Each huge page has a descriptor (allocated from the heap, outside the huge page)
+ *      with a bitmap of its used pages and their count. An allocation goes to the
+ *      fullest huge page which has a free run long enough, so that allocations pack
+ *      into few huge pages and the others drain. A huge page is unmapped only once all
+ *      its pages are free: a partially used huge page is never split by the kernel
+ *      because of us. One empty huge page is kept mapped as a spare, so that a program
+ *      allocating and freeing around a huge page boundary does not map and unmap a huge
+ *      page on every call; a second empty huge page is unmapped.
+ *
+ *      hugepages -> [used 510/512] -> [used 3/512] -> [used 200/512] -> NULL
+ *                         ^
+ *                         `-- picked first for a run of 2 pages
+ */
+
+struct hugepage {
+        struct hugepage         *next;
+        void                    *mem;
+        unsigned                used;
+        uint64_t                bits[HUGEPAGE_NWORDS];
+};
+
+struct hp_filler {
+        struct heap             *h;
+        struct hugepage         *pages;
+        struct hugepage         *spare;
+        unsigned                nhugepages;
+        size_t                  used_pages;
+};
+
+void hp_filler_init(struct hp_filler *f, struct heap *h)
+{
+        f->h = h;
+        f->pages = NULL;
+        f->spare = NULL;
+        f->nhugepages = 0;
+        f->used_pages = 0;
+}
+
+struct hugepage *hugepage_map(struct hp_filler *f)
+{
+        struct hugepage *hp = heap_alloc(f->h, sizeof(struct hugepage));
+
+        if (hp == NULL)
+                return NULL;
+
+        /* over-map to trim the mapping to a huge page boundary */
+        const size_t len = 2 * HEAP_HUGEPAGE_SIZE;
+        uint8_t *mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (mem == MAP_FAILED) {
+                heap_free(f->h, hp);
+                return NULL;
+        }
+
+        uint8_t *aligned = (uint8_t *)(((uintptr_t)mem + HEAP_HUGEPAGE_SIZE - 1) & ~(uintptr_t)(HEAP_HUGEPAGE_SIZE - 1));
+
+        if (aligned > mem)
+                munmap(mem, aligned - mem);
+        if (aligned + HEAP_HUGEPAGE_SIZE < mem + len)
+                munmap(aligned + HEAP_HUGEPAGE_SIZE, (mem + len) - (aligned + HEAP_HUGEPAGE_SIZE));
+
+#ifdef MADV_HUGEPAGE
+        madvise(aligned, HEAP_HUGEPAGE_SIZE, MADV_HUGEPAGE);
+#endif
+
+        hp->mem = aligned;
+        hp->used = 0;
+        memset(hp->bits, 0, sizeof(hp->bits));
+
+        hp->next = f->pages;
+        f->pages = hp;
+        f->nhugepages++;
+
+        if (f->h->hft & HEAP_DEBUG)
+                printf("hp_filler info: mapped huge page @%p\n", aligned);
+
+        return hp;
+}
+
+void hugepage_unmap(struct hp_filler *f, struct hugepage *hp)
+{
+        struct hugepage **link = &f->pages;
+
+        while (*link != hp)
+                link = &(*link)->next;
+
+        *link = hp->next;
+        f->nhugepages--;
+
+        if (f->spare == hp)
+                f->spare = NULL;
+
+        munmap(hp->mem, HEAP_HUGEPAGE_SIZE);
+        heap_free(f->h, hp);
+}
+
+/* first free run of npages pages in hp, or -1 */
+int hugepage_find_run(struct hugepage *hp, unsigned npages)
+{
+        unsigned run = 0;
+
+        for (unsigned i = 0; i < HUGEPAGE_NPAGES; i++) {
+                /* skip full words */
+                if ((i % 64) == 0 && hp->bits[i / 64] == ~0ULL) {
+                        run = 0;
+                        i += 63;
+                        continue;
+                }
+
+                run = bit64_check(hp->bits, i) ? 0 : run + 1;
+
+                if (run == npages)
+                        return (int)(i + 1 - npages);
+        }
+
+        return -1;
+}
+
+/* allocate npages contiguous pages (at most one huge page) */
+void *hp_filler_alloc(struct hp_filler *f, size_t npages)
+{
+        if (npages == 0 || npages > HUGEPAGE_NPAGES)
+                return NULL;
+
+        struct hugepage *best = NULL;
+        int best_first = -1;
+
+        /* fullest huge page first */
+        for (struct hugepage *hp = f->pages; hp != NULL; hp = hp->next) {
+                if (HUGEPAGE_NPAGES - hp->used < npages || (best != NULL && hp->used <= best->used))
+                        continue;
+
+                const int first = hugepage_find_run(hp, npages);
+
+                if (first != -1) {
+                        best = hp;
+                        best_first = first;
+                }
+        }
+
+        if (best == NULL) {
+                best = hugepage_map(f);
+
+                if (best == NULL)
+                        return NULL;
+
+                best_first = 0;
+        }
+
+        if (best == f->spare)
+                f->spare = NULL;
+
+        for (size_t i = best_first; i < best_first + npages; i++)
+                bit64_set(best->bits, i);
+
+        best->used += npages;
+        f->used_pages += npages;
+
+        return (void *)((uintptr_t)best->mem + (best_first * HEAP_PAGE_SIZE));
+}
+
+struct hugepage *hp_filler_owner(struct hp_filler *f, void *ptr)
+{
+        void *mem = (void *)((uintptr_t)ptr & ~(uintptr_t)(HEAP_HUGEPAGE_SIZE - 1));
+
+        for (struct hugepage *hp = f->pages; hp != NULL; hp = hp->next) {
+                if (hp->mem == mem)
+                        return hp;
+        }
+
+        return NULL;
+}
+
+void hp_filler_free(struct hp_filler *f, void *ptr, size_t npages)
+{
+        if (ptr == NULL)
+                return;
+
+        struct hugepage *hp = hp_filler_owner(f, ptr);
+
+        if (hp == NULL) {
+                if (f->h->hft & HEAP_DEBUG)
+                        printf("hp_filler info: @%p not owned by filler\n", ptr);
+                return;
+        }
+
+        const size_t first = ((uintptr_t)ptr - (uintptr_t)hp->mem) / HEAP_PAGE_SIZE;
+
+        for (size_t i = first; i < first + npages; i++)
+                bit64_clear(hp->bits, i);
+
+        hp->used -= npages;
+        f->used_pages -= npages;
+
+        /* release only huge pages that are completely empty, and keep one of them */
+        if (hp->used == 0) {
+                if (f->spare == NULL)
+                        f->spare = hp;
+                else
+                        hugepage_unmap(f, hp);
+        }
+}
+
+size_t hp_filler_npages(size_t nbytes)
+{
+        return (nbytes + HEAP_PAGE_SIZE - 1) / HEAP_PAGE_SIZE;
+}
+
+void hp_filler_term(struct hp_filler *f)
+{
+        if (f == NULL)
+                return;
+
+        while (f->pages != NULL)
+                hugepage_unmap(f, f->pages);
+
+        f->used_pages = 0;
+}
+
+#endif
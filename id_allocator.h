@@ -0,0 +1,357 @@
+/* id_allocator.h -- Allocation of dense integer ids from a hierarchical bitmap
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef ID_ALLOCATOR_H
+#define ID_ALLOCATOR_H
+
+#include "heap.h"
+#include "bit.h"
+
+enum id_limits {
+        ID_WORD_BITS = 64,
+        ID_MAX_LEVELS = 6,
+        ID_RETRIES = 16
+};
+
+enum id_flags {
+        I_CONCURRENT
+};
+
+#define ID_CONCURRENT bit(I_CONCURRENT)
+
+/* Design of the system:
+ *      Ids 0..nids-1 are tracked by a 64-ary tree of bitmaps. A bit of the leaf level is
+ *      set when its id is free. A bit of an upper level is set when the word below it
+ *      has at least one bit set, so the lowest free id is found by following the lowest
+ *      set bit of one word per level: O(log64 n) for alloc and free.
+ *
+ *      levels[2]  [1 0 1 ...]                          <- 1 word
+ *                  |   `-------------------.
+ *      levels[1]  [0 1 1 ...] ...          [...]       <- 64 words
+ *                    |
+ *      levels[0]  [...] [0 0 1 0 ...] ...               <- leaves, bit = free id
+ *
+ *      In concurrent mode (ID_CONCURRENT) words are updated with atomic operations.
+ *      Leaves are the only source of truth: upper levels are hints which can briefly
+ *      be stale; a bit cleared in an upper level is checked again against the word below
+ *      and restored if the word was refilled meanwhile, and a stale bit found on the way
+ *      down is cleared before retrying.
+ *      Range allocation is not available in concurrent mode.
+ */
+
+struct id_heap {
+        struct heap     *h;
+        unsigned        flags;
+        size_t          nids;
+        int             nlevels;
+        uint64_t        *levels[ID_MAX_LEVELS];
+        size_t          nwords[ID_MAX_LEVELS];
+};
+
+uint64_t id_load(struct id_heap *ids, uint64_t *w)
+{
+        if (ids->flags & ID_CONCURRENT)
+                return __atomic_load_n(w, __ATOMIC_ACQUIRE);
+
+        return *w;
+}
+
+/* set bit b of word w. returns the previous value of the word */
+uint64_t id_word_set(struct id_heap *ids, uint64_t *w, unsigned b)
+{
+        if (ids->flags & ID_CONCURRENT)
+                return __atomic_fetch_or(w, bit64(b), __ATOMIC_ACQ_REL);
+
+        const uint64_t old = *w;
+
+        *w = old | bit64(b);
+
+        return old;
+}
+
+/* clear bit b of word w. returns the new value of the word */
+uint64_t id_word_clear(struct id_heap *ids, uint64_t *w, unsigned b)
+{
+        if (ids->flags & ID_CONCURRENT)
+                return __atomic_and_fetch(w, ~bit64(b), __ATOMIC_ACQ_REL);
+
+        *w &= ~bit64(b);
+
+        return *w;
+}
+
+/* word index at level l became non-empty: set its bit in the levels above */
+void id_summary_set(struct id_heap *ids, int l, size_t index)
+{
+        for (l = l + 1; l < ids->nlevels; l++) {
+                const uint64_t old = id_word_set(ids, &ids->levels[l][index / ID_WORD_BITS], index % ID_WORD_BITS);
+
+                if (old != 0)
+                        return;
+
+                index /= ID_WORD_BITS;
+        }
+}
+
+/* word index at level l became empty: clear its bit in the levels above */
+void id_summary_clear(struct id_heap *ids, int l, size_t index)
+{
+        for (; l + 1 < ids->nlevels; l++) {
+                uint64_t *parent = &ids->levels[l + 1][index / ID_WORD_BITS];
+                const uint64_t w = id_word_clear(ids, parent, index % ID_WORD_BITS);
+
+                /* the word was refilled by a concurrent free: restore the hint */
+                if ((ids->flags & ID_CONCURRENT) && id_load(ids, &ids->levels[l][index]) != 0) {
+                        id_summary_set(ids, l, index);
+                        return;
+                }
+
+                if (w != 0)
+                        return;
+
+                index /= ID_WORD_BITS;
+        }
+}
+
+int id_heap_init(struct id_heap *ids, struct heap *h, size_t nids, unsigned flags)
+{
+        if (nids == 0)
+                return -1;
+
+        ids->h = h;
+        ids->flags = flags;
+        ids->nids = nids;
+        ids->nlevels = 0;
+
+        size_t nbits = nids;
+
+        do {
+                const size_t nwords = (nbits + ID_WORD_BITS - 1) / ID_WORD_BITS;
+
+                if (ids->nlevels == ID_MAX_LEVELS)
+                        goto fail;
+
+                ids->nwords[ids->nlevels] = nwords;
+                ids->levels[ids->nlevels] = heap_alloc(h, nwords * sizeof(uint64_t));
+
+                if (ids->levels[ids->nlevels] == NULL)
+                        goto fail;
+
+                memset(ids->levels[ids->nlevels], 0, nwords * sizeof(uint64_t));
+                ids->nlevels++;
+                nbits = nwords;
+        } while (nbits > 1);
+
+        /* every id is free */
+        for (int l = 0; l < ids->nlevels; l++) {
+                const size_t n = (l == 0) ? nids : ids->nwords[l - 1];
+
+                for (size_t i = 0; i < n; i++)
+                        bit64_set(ids->levels[l], i);
+        }
+
+        return 0;
+
+fail:
+        /* release the levels allocated before the failure */
+        while (ids->nlevels > 0)
+                heap_free(h, ids->levels[--ids->nlevels]);
+
+        return -1;
+}
+
+void id_heap_term(struct id_heap *ids)
+{
+        if (ids == NULL)
+                return;
+
+        for (int l = 0; l < ids->nlevels; l++)
+                heap_free(ids->h, ids->levels[l]);
+
+        ids->nlevels = 0;
+}
+
+/* index of the leaf word holding the lowest free id, or -1 if a stale hint was met */
+int64_t id_descend(struct id_heap *ids)
+{
+        size_t index = 0;
+
+        for (int l = ids->nlevels - 1; l > 0; l--) {
+                const uint64_t w = id_load(ids, &ids->levels[l][index]);
+
+                if (w == 0) {
+                        if (l != ids->nlevels - 1)
+                                id_summary_clear(ids, l, index);
+                        return -1;
+                }
+
+                index = (index * ID_WORD_BITS) + trailing_zeros_count64(w);
+        }
+
+        return (int64_t)index;
+}
+
+/* allocate the lowest free id. returns -1 if every id is in use */
+int64_t id_alloc(struct id_heap *ids)
+{
+        for (int retry = 0; retry < ID_RETRIES; retry++) {
+                if (id_load(ids, &ids->levels[ids->nlevels - 1][0]) == 0)
+                        return -1;
+
+                const int64_t index = id_descend(ids);
+
+                if (index == -1)
+                        continue;
+
+                uint64_t *leaf = &ids->levels[0][index];
+                uint64_t w = id_load(ids, leaf);
+
+                if (!(ids->flags & ID_CONCURRENT)) {
+                        const unsigned b = trailing_zeros_count64(w);
+
+                        if (id_word_clear(ids, leaf, b) == 0)
+                                id_summary_clear(ids, 0, index);
+
+                        return (index * ID_WORD_BITS) + b;
+                }
+
+                while (w != 0) {
+                        const unsigned b = trailing_zeros_count64(w);
+                        const uint64_t next = w & ~bit64(b);
+
+                        if (__atomic_compare_exchange_n(leaf, &w, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                                if (next == 0)
+                                        id_summary_clear(ids, 0, index);
+
+                                return (index * ID_WORD_BITS) + b;
+                        }
+                }
+
+                /* leaf emptied by other threads, its hint is stale */
+                id_summary_clear(ids, 0, index);
+        }
+
+        /* hints keep changing under us: scan the leaves */
+        for (size_t i = 0; i < ids->nwords[0]; i++) {
+                uint64_t *leaf = &ids->levels[0][i];
+                uint64_t w = id_load(ids, leaf);
+
+                while (w != 0) {
+                        const unsigned b = trailing_zeros_count64(w);
+
+                        if (__atomic_compare_exchange_n(leaf, &w, w & ~bit64(b), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                                if ((w & ~bit64(b)) == 0)
+                                        id_summary_clear(ids, 0, i);
+
+                                return (i * ID_WORD_BITS) + b;
+                        }
+                }
+        }
+
+        return -1;
+}
+
+/* returns 0 on success, -1 if id is out of range or already free */
+int id_free(struct id_heap *ids, int64_t id)
+{
+        if (id < 0 || (size_t)id >= ids->nids)
+                return -1;
+
+        const size_t index = (size_t)id / ID_WORD_BITS;
+        const uint64_t old = id_word_set(ids, &ids->levels[0][index], id % ID_WORD_BITS);
+
+        if (old & bit64(id % ID_WORD_BITS)) {
+                if (ids->h->hft & HEAP_DEBUG)
+                        printf("id_heap info: id %lld freed twice\n", (long long)id);
+                return -1;
+        }
+
+        if (old == 0)
+                id_summary_set(ids, 0, index);
+
+        return 0;
+}
+
+int id_is_free(struct id_heap *ids, int64_t id)
+{
+        if (id < 0 || (size_t)id >= ids->nids)
+                return 0;
+
+        return (id_load(ids, &ids->levels[0][id / ID_WORD_BITS]) & bit64(id % ID_WORD_BITS)) != 0;
+}
+
+/* allocate the lowest run of n consecutive ids. returns the first id or -1 */
+int64_t id_alloc_range(struct id_heap *ids, size_t n)
+{
+        if (n == 0 || n > ids->nids || (ids->flags & ID_CONCURRENT))
+                return -1;
+
+        uint64_t *leaves = ids->levels[0];
+        size_t start = 0, run = 0;
+
+        for (size_t i = 0; i < ids->nwords[0] && run < n; i++) {
+                const uint64_t w = leaves[i];
+
+                if (w == ~0ULL && run + ID_WORD_BITS < n) {
+                        if (run == 0)
+                                start = i * ID_WORD_BITS;
+                        run += ID_WORD_BITS;
+                        continue;
+                }
+
+                if (w == 0) {
+                        run = 0;
+                        continue;
+                }
+
+                for (unsigned b = 0; b < ID_WORD_BITS && run < n; b++) {
+                        if (w & bit64(b)) {
+                                if (run == 0)
+                                        start = (i * ID_WORD_BITS) + b;
+                                run++;
+                        } else {
+                                run = 0;
+                        }
+                }
+        }
+
+        if (run < n)
+                return -1;
+
+        for (size_t id = start; id < start + n; id++) {
+                const size_t index = id / ID_WORD_BITS;
+
+                if (id_word_clear(ids, &leaves[index], id % ID_WORD_BITS) == 0)
+                        id_summary_clear(ids, 0, index);
+        }
+
+        return (int64_t)start;
+}
+
+void id_free_range(struct id_heap *ids, int64_t first, size_t n)
+{
+        for (size_t i = 0; i < n; i++)
+                id_free(ids, first + i);
+}
+
+#endif
@@ -0,0 +1,280 @@
+/* intern.h -- String interning arena
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "heap.h"
+#include "bit.h"
+#include "scratch_allocator.h"
+#include "arena_containers.h"
+
+enum intern_limits {
+        INTERN_GROUP = 16,
+        INTERN_EMPTY = 0x80,
+        INTERN_MIN_CAPACITY = 64
+};
+
+/* Design of the system:
+ *      Unique strings are copied once in a scratch chain and never move, so the pointer
+ *      returned for a string is stable until intern_term() and two interned strings are
+ *      equal iff their pointers (or ids) are equal. Ids are dense 32-bit indices in the
+ *      order of insertion.
+ *
+ *      The index is an open-addressing table probed by groups of 16 slots. Each slot has
+ *      a control byte: INTERN_EMPTY or the 7 low bits of the hash of its string. A probe
+ *      compares the 16 control bytes of a group with one SSE2 compare (scalar loop
+ *      without SSE2) and only compares the strings of matching slots.
+ *
+ *      ctrl  [h|h|E|h|E|E|...|h]  [E|h|...]       <- group 0, group 1, ...
+ *      slots [id|id| |id| | |...]                  <- id of the string in strs[]
+ *
+ *      Each string is stored with its length as prefix and a terminating NUL.
+ */
+
+struct intern_str {
+        uint32_t        len;
+        char            data[];
+};
+
+struct interner {
+        struct heap             *h;
+        struct scratch_chain    chars;
+        uint8_t                 *ctrl;
+        uint32_t                *slots;
+        size_t                  cap;
+        struct intern_str       **strs;
+        uint32_t                len;
+        uint32_t                strs_cap;
+};
+
+int intern_alloc_table(struct interner *in, size_t cap)
+{
+        in->ctrl = heap_aligned_alloc(in->h, cap, INTERN_GROUP);
+        in->slots = heap_alloc(in->h, cap * sizeof(uint32_t));
+
+        if (in->ctrl == NULL || in->slots == NULL) {
+                if (in->ctrl != NULL)
+                        heap_aligned_free(in->h, in->ctrl);
+                heap_free(in->h, in->slots);
+                return -1;
+        }
+
+        memset(in->ctrl, INTERN_EMPTY, cap);
+        in->cap = cap;
+
+        return 0;
+}
+
+int intern_init(struct interner *in, struct heap *h, size_t chunk_size)
+{
+        in->h = h;
+        in->len = 0;
+        in->strs_cap = 0;
+        in->strs = NULL;
+
+        if (scratch_chain_init(&in->chars, h, chunk_size, sizeof(uint32_t)) != 0)
+                return -1;
+
+        if (intern_alloc_table(in, INTERN_MIN_CAPACITY) != 0) {
+                scratch_chain_term(&in->chars);
+                return -1;
+        }
+
+        return 0;
+}
+
+void intern_term(struct interner *in)
+{
+        if (in == NULL)
+                return;
+
+        heap_aligned_free(in->h, in->ctrl);
+        heap_free(in->h, in->slots);
+        heap_free(in->h, in->strs);
+        scratch_chain_term(&in->chars);
+}
+
+/* bitmask of the control bytes of a group equal to c */
+uint32_t intern_group_match(const uint8_t *group, uint8_t c)
+{
+#ifdef __SSE2__
+        const __m128i g = _mm_load_si128((const __m128i *)group);
+
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)c)));
+#else
+        uint32_t mask = 0;
+
+        for (int i = 0; i < INTERN_GROUP; i++)
+                mask |= (uint32_t)(group[i] == c) << i;
+
+        return mask;
+#endif
+}
+
+/* returns the slot holding the string, or the empty slot where it would be inserted */
+size_t intern_find(struct interner *in, const char *str, uint32_t len, uint64_t hash, int *found)
+{
+        const uint8_t h2 = hash & 0x7f;
+        const size_t ngroups = in->cap / INTERN_GROUP;
+        size_t g = (hash >> 7) & (ngroups - 1);
+
+        for (;;) {
+                const uint8_t *group = in->ctrl + (g * INTERN_GROUP);
+                uint32_t mask = intern_group_match(group, h2);
+
+                while (mask != 0) {
+                        const size_t i = (g * INTERN_GROUP) + trailing_zeros_count(mask);
+                        const struct intern_str *s = in->strs[in->slots[i]];
+
+                        if (s->len == len && memcmp(s->data, str, len) == 0) {
+                                *found = 1;
+                                return i;
+                        }
+
+                        mask &= mask - 1;
+                }
+
+                mask = intern_group_match(group, INTERN_EMPTY);
+
+                if (mask != 0) {
+                        *found = 0;
+                        return (g * INTERN_GROUP) + trailing_zeros_count(mask);
+                }
+
+                g = (g + 1) & (ngroups - 1);
+        }
+}
+
+int intern_grow(struct interner *in)
+{
+        uint8_t *ctrl = in->ctrl;
+        uint32_t *slots = in->slots;
+        const size_t cap = in->cap;
+
+        if (intern_alloc_table(in, cap * 2) != 0) {
+                in->ctrl = ctrl;
+                in->slots = slots;
+                in->cap = cap;
+                return -1;
+        }
+
+        for (size_t i = 0; i < cap; i++) {
+                if (ctrl[i] == INTERN_EMPTY)
+                        continue;
+
+                const struct intern_str *s = in->strs[slots[i]];
+                const uint64_t hash = arena_hash_bytes(s->data, s->len);
+                int found;
+                const size_t j = intern_find(in, s->data, s->len, hash, &found);
+
+                in->ctrl[j] = hash & 0x7f;
+                in->slots[j] = slots[i];
+        }
+
+        heap_aligned_free(in->h, ctrl);
+        heap_free(in->h, slots);
+
+        return 0;
+}
+
+int intern_push(struct interner *in, struct intern_str *s)
+{
+        if (in->len == in->strs_cap) {
+                const uint32_t cap = (in->strs_cap == 0) ? INTERN_MIN_CAPACITY : in->strs_cap * 2;
+                struct intern_str **strs = heap_alloc(in->h, cap * sizeof(struct intern_str *));
+
+                if (strs == NULL)
+                        return -1;
+
+                if (in->strs != NULL)
+                        memcpy(strs, in->strs, in->len * sizeof(struct intern_str *));
+
+                heap_free(in->h, in->strs);
+                in->strs = strs;
+                in->strs_cap = cap;
+        }
+
+        in->strs[in->len++] = s;
+
+        return 0;
+}
+
+/* intern len bytes of str. returns the stable copy and stores its id in *id (if not NULL) */
+const char *intern(struct interner *in, const char *str, size_t len, uint32_t *id)
+{
+        if (len > UINT32_MAX || in->len == UINT32_MAX)
+                return NULL;
+
+        /* keep the load factor under 7/8 */
+        if ((in->len + 1) * 8 > in->cap * 7 && intern_grow(in) != 0)
+                return NULL;
+
+        const uint64_t hash = arena_hash_bytes(str, len);
+        int found;
+        const size_t i = intern_find(in, str, (uint32_t)len, hash, &found);
+
+        if (!found) {
+                struct intern_str *s = scratch_chain_alloc(&in->chars, sizeof(struct intern_str) + len + 1,
+                                                           _Alignof(struct intern_str));
+
+                if (s == NULL || intern_push(in, s) != 0)
+                        return NULL;
+
+                s->len = (uint32_t)len;
+                memcpy(s->data, str, len);
+                s->data[len] = '\0';
+
+                in->ctrl[i] = hash & 0x7f;
+                in->slots[i] = in->len - 1;
+        }
+
+        if (id != NULL)
+                *id = in->slots[i];
+
+        return in->strs[in->slots[i]]->data;
+}
+
+const char *intern_cstr(struct interner *in, const char *str, uint32_t *id)
+{
+        return intern(in, str, strlen(str), id);
+}
+
+const char *intern_lookup(struct interner *in, uint32_t id)
+{
+        return (id < in->len) ? in->strs[id]->data : NULL;
+}
+
+/* length of an interned string, read from its prefix */
+uint32_t intern_len(const char *str)
+{
+        return ((const struct intern_str *)(str - offsetof(struct intern_str, data)))->len;
+}
+
+#endif
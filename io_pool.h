@@ -0,0 +1,154 @@
+/* io_pool.h -- Block pool of O_DIRECT capable I/O buffers
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "block_allocator.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define IO_POOL_URING 1
+#endif
+
+#define IO_POOL_SECTOR 4096
+
+/* Specialization of the block pool for direct I/O.
+ *
+ * Design of the pool:
+ *      Block size is rounded up to a multiple of the page size (itself a multiple of
+ *      IO_POOL_SECTOR) and the pool memory is page aligned, so every block satisfies
+ *      the buffer address and length constraints of O_DIRECT.
+ *      The pool can be registered once with an io_uring instance as fixed buffers
+ *      (one iovec per block). The buffer index of a block is its index in the pool,
+ *      which is returned together with the pointer at allocation and can be passed
+ *      as buf_index to IORING_OP_READ_FIXED / IORING_OP_WRITE_FIXED.
+ *
+ *      +---------+---------+---------+-----+---------+
+ *      | block 0 | block 1 | block 2 | ... | blk 254 |   <- registered iovec[i]
+ *      +---------+---------+---------+-----+---------+
+ */
+
+struct io_buf {
+        void            *ptr;
+        int             index;
+};
+
+struct io_pool {
+        struct block_heap       blk;
+        struct heap             *h;
+        int                     ring_fd;
+};
+
+size_t io_pool_block_size(size_t nbytes)
+{
+        long page = sysconf(_SC_PAGESIZE);
+        size_t align = (page > IO_POOL_SECTOR) ? (size_t)page : IO_POOL_SECTOR;
+
+        return (nbytes + align - 1) & ~(align - 1);
+}
+
+int io_pool_init(struct io_pool *io, struct heap *h, size_t nbytes)
+{
+        if (nbytes == 0)
+                return -1;
+
+        const size_t block_size = io_pool_block_size(nbytes);
+
+        io->h = h;
+        io->ring_fd = -1;
+
+        return block_heap_init(&io->blk, h, block_size, io_pool_block_size(1));
+}
+
+struct io_buf io_pool_alloc(struct io_pool *io)
+{
+        struct io_buf buf = { NULL, -1 };
+
+        buf.ptr = block_alloc(&io->blk);
+
+        if (buf.ptr != NULL)
+                buf.index = (int)(((uintptr_t)buf.ptr - (uintptr_t)io->blk.data) / io->blk.block_size);
+
+        return buf;
+}
+
+void io_pool_free(struct io_pool *io, struct io_buf buf)
+{
+        block_free(&io->blk, buf.ptr);
+}
+
+/* register every block of the pool as an io_uring fixed buffer.
+ * returns 0 on success, -1 if io_uring is not available or registration failed. */
+int io_pool_register(struct io_pool *io, int ring_fd)
+{
+#ifdef IO_POOL_URING
+        struct iovec iov[BLOCK_HEAP_MAX];
+
+        if (io->ring_fd != -1)
+                return -1;
+
+        for (int i = 0; i < BLOCK_HEAP_MAX; i++) {
+                iov[i].iov_base = (void *)((uintptr_t)io->blk.data + (i * io->blk.block_size));
+                iov[i].iov_len = io->blk.block_size;
+        }
+
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, BLOCK_HEAP_MAX) < 0) {
+                if (io->h->hft & HEAP_DEBUG)
+                        printf("io_pool info: could not register fixed buffers\n");
+                return -1;
+        }
+
+        io->ring_fd = ring_fd;
+
+        return 0;
+#else
+        return -1;
+#endif
+}
+
+void io_pool_unregister(struct io_pool *io)
+{
+#ifdef IO_POOL_URING
+        if (io->ring_fd == -1)
+                return;
+
+        syscall(__NR_io_uring_register, io->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        io->ring_fd = -1;
+#endif
+}
+
+void io_pool_term(struct io_pool *io)
+{
+        if (io == NULL)
+                return;
+
+        io_pool_unregister(io);
+        block_heap_term(&io->blk, io->h);
+}
+
+#endif
@@ -0,0 +1,299 @@
+/* large_allocator.h -- Large allocations served from a cache of retained mappings
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef LARGE_ALLOCATOR_H
+#define LARGE_ALLOCATOR_H
+
+#include <time.h>
+#include <sys/mman.h>
+
+#include "heap.h"
+#include "tree.h"
+
+#define LARGE_DECAY_MS 10000
+
+/* Design of the system:
+ *      Allocations too large for the buddy arena are mapped with mmap. Instead of being
+ *      unmapped at deallocation, which costs a TLB shootdown on every core running the
+ *      process, the mappings are retained as free extents and reused.
+ *      Free extents are linked in two trees (see tree.h), like in extent_allocator.h:
+ *              by_size: ordered by (size, address), for best fit
+ *              by_addr: ordered by address, to find the neighbours of a freed extent
+ *      An allocation takes the smallest extent which fits, the lowest addressed one
+ *      among equals, and returns the pages it does not use to the cache. A freed extent
+ *      is merged with the free extents adjacent to it in memory. Both are O(log n) in
+ *      the number of free extents.
+ *      An extent idle for longer than the decay time is decommitted (MADV_DONTNEED): its
+ *      physical pages go back to the system but the mapping stays. Mappings are only
+ *      unmapped when the retained bytes exceed an optional cap, or at term.
+ *
+ *      by_size:  (16 pages @0x7f40..) < (16 pages @0x7f80..) < (300 pages @0x7f00..)
+ *
+ *      Deallocation takes the size of the allocation (like munmap).
+ */
+
+struct large_extent {
+        struct tree_node        by_size;
+        struct tree_node        by_addr;
+        void                    *mem;
+        size_t                  nbytes;
+        uint64_t                freed;
+        int                     committed;
+};
+
+struct large_cache {
+        struct heap             *h;
+        struct tree             by_size;
+        struct tree             by_addr;
+        uint64_t                decay_ns;
+        uint64_t                last_decay;
+        size_t                  retained;
+        size_t                  max_retained;
+        size_t                  mapped;
+};
+
+uint64_t large_now(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+size_t large_roundup(size_t nbytes)
+{
+        return (nbytes + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+}
+
+int large_cmp_size(const struct tree_node *a, const struct tree_node *b)
+{
+        const struct large_extent *x = tree_entry(a, struct large_extent, by_size);
+        const struct large_extent *y = tree_entry(b, struct large_extent, by_size);
+
+        if (x->nbytes != y->nbytes)
+                return (x->nbytes < y->nbytes) ? -1 : 1;
+        if (x->mem != y->mem)
+                return ((uintptr_t)x->mem < (uintptr_t)y->mem) ? -1 : 1;
+
+        return 0;
+}
+
+int large_cmp_addr(const struct tree_node *a, const struct tree_node *b)
+{
+        const struct large_extent *x = tree_entry(a, struct large_extent, by_addr);
+        const struct large_extent *y = tree_entry(b, struct large_extent, by_addr);
+
+        if (x->mem != y->mem)
+                return ((uintptr_t)x->mem < (uintptr_t)y->mem) ? -1 : 1;
+
+        return 0;
+}
+
+/* max_retained: bytes kept mapped while unused, 0 for no cap */
+void large_cache_init(struct large_cache *lc, struct heap *h, unsigned decay_ms, size_t max_retained)
+{
+        lc->h = h;
+        lc->decay_ns = (uint64_t)decay_ms * 1000000ULL;
+        lc->last_decay = large_now();
+        lc->retained = 0;
+        lc->max_retained = max_retained;
+        lc->mapped = 0;
+
+        tree_init(&lc->by_size, large_cmp_size);
+        tree_init(&lc->by_addr, large_cmp_addr);
+}
+
+void large_extent_insert(struct large_cache *lc, struct large_extent *e)
+{
+        tree_insert(&lc->by_size, &e->by_size);
+        tree_insert(&lc->by_addr, &e->by_addr);
+        lc->retained += e->nbytes;
+}
+
+void large_extent_remove(struct large_cache *lc, struct large_extent *e)
+{
+        tree_remove(&lc->by_size, &e->by_size);
+        tree_remove(&lc->by_addr, &e->by_addr);
+        lc->retained -= e->nbytes;
+}
+
+/* merge e with the free extents adjacent in memory, then insert it */
+void large_extent_coalesce(struct large_cache *lc, struct large_extent *e)
+{
+        struct large_extent key = { .mem = e->mem };
+        struct tree_node *p = tree_predecessor(&lc->by_addr, &key.by_addr);
+        struct tree_node *n = tree_lower_bound(&lc->by_addr, &key.by_addr);
+        struct large_extent *prev = (p != NULL) ? tree_entry(p, struct large_extent, by_addr) : NULL;
+        struct large_extent *next = (n != NULL) ? tree_entry(n, struct large_extent, by_addr) : NULL;
+
+        if (prev != NULL && (uintptr_t)prev->mem + prev->nbytes == (uintptr_t)e->mem) {
+                large_extent_remove(lc, prev);
+                e->mem = prev->mem;
+                e->nbytes += prev->nbytes;
+                e->committed |= prev->committed;
+                heap_free(lc->h, prev);
+        }
+
+        if (next != NULL && (uintptr_t)e->mem + e->nbytes == (uintptr_t)next->mem) {
+                large_extent_remove(lc, next);
+                e->nbytes += next->nbytes;
+                e->committed |= next->committed;
+                heap_free(lc->h, next);
+        }
+
+        large_extent_insert(lc, e);
+}
+
+void large_cache_decay_at(struct large_cache *lc, struct tree_node *n, uint64_t now)
+{
+        if (n == NULL)
+                return;
+
+        struct large_extent *e = tree_entry(n, struct large_extent, by_addr);
+
+        if (e->committed && now - e->freed >= lc->decay_ns) {
+                madvise(e->mem, e->nbytes, MADV_DONTNEED);
+                e->committed = 0;
+        }
+
+        large_cache_decay_at(lc, n->left, now);
+        large_cache_decay_at(lc, n->right, now);
+}
+
+/* decommit the extents idle for longer than the decay time */
+void large_cache_decay(struct large_cache *lc)
+{
+        const uint64_t now = large_now();
+
+        lc->last_decay = now;
+        large_cache_decay_at(lc, lc->by_addr.root, now);
+}
+
+void large_cache_tick(struct large_cache *lc)
+{
+        /* walk the extents at most 4 times per decay period */
+        if (large_now() - lc->last_decay >= lc->decay_ns / 4)
+                large_cache_decay(lc);
+}
+
+void *large_alloc(struct large_cache *lc, size_t nbytes)
+{
+        if (nbytes == 0)
+                return NULL;
+
+        nbytes = large_roundup(nbytes);
+        large_cache_tick(lc);
+
+        struct large_extent key = { .mem = NULL, .nbytes = nbytes };
+        struct tree_node *n = tree_lower_bound(&lc->by_size, &key.by_size);
+
+        if (n != NULL) {
+                struct large_extent *e = tree_entry(n, struct large_extent, by_size);
+                void *ptr = e->mem;
+
+                large_extent_remove(lc, e);
+
+                if (e->nbytes == nbytes) {
+                        heap_free(lc->h, e);
+                } else {
+                        /* give the tail back to the cache */
+                        e->mem = (void *)((uintptr_t)e->mem + nbytes);
+                        e->nbytes -= nbytes;
+                        large_extent_insert(lc, e);
+                }
+
+                return ptr;
+        }
+
+        void *ptr = mmap(NULL, nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (ptr == MAP_FAILED) {
+                if (lc->h->hft & HEAP_DEBUG)
+                        printf("large_cache info: could not map requested size\n");
+                return NULL;
+        }
+
+        lc->mapped += nbytes;
+
+        return ptr;
+}
+
+/* unmap the largest extents (the highest addressed among equals) until under the cap */
+void large_cache_shrink(struct large_cache *lc, size_t max_retained)
+{
+        struct large_extent last = { .mem = (void *)UINTPTR_MAX, .nbytes = SIZE_MAX };
+
+        while (lc->retained > max_retained) {
+                struct tree_node *n = tree_predecessor(&lc->by_size, &last.by_size);
+
+                if (n == NULL)
+                        break;
+
+                struct large_extent *e = tree_entry(n, struct large_extent, by_size);
+
+                large_extent_remove(lc, e);
+                lc->mapped -= e->nbytes;
+                munmap(e->mem, e->nbytes);
+                heap_free(lc->h, e);
+        }
+}
+
+void large_free(struct large_cache *lc, void *ptr, size_t nbytes)
+{
+        if (ptr == NULL || nbytes == 0)
+                return;
+
+        nbytes = large_roundup(nbytes);
+
+        struct large_extent *e = heap_alloc(lc->h, sizeof(struct large_extent));
+
+        /* no descriptor, no caching */
+        if (e == NULL) {
+                munmap(ptr, nbytes);
+                lc->mapped -= nbytes;
+                return;
+        }
+
+        e->mem = ptr;
+        e->nbytes = nbytes;
+        e->freed = large_now();
+        e->committed = 1;
+
+        large_extent_coalesce(lc, e);
+
+        if (lc->max_retained != 0 && lc->retained > lc->max_retained)
+                large_cache_shrink(lc, lc->max_retained);
+
+        large_cache_tick(lc);
+}
+
+void large_cache_term(struct large_cache *lc)
+{
+        if (lc == NULL)
+                return;
+
+        large_cache_shrink(lc, 0);
+}
+
+#endif
@@ -0,0 +1,262 @@
+/* memfd_arena.h -- Arena on a memfd, cloned as private copy-on-write mappings
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef MEMFD_ARENA_H
+#define MEMFD_ARENA_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "heap.h"
+#include "scratch_allocator.h"
+#include "scratch_image.h"
+#include "rel_ptr.h"
+
+/* not declared without _GNU_SOURCE */
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC             0x0001U
+#define MFD_ALLOW_SEALING       0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS             1033
+#define F_SEAL_SEAL             0x0001
+#define F_SEAL_SHRINK           0x0002
+#define F_SEAL_GROW             0x0004
+#define F_SEAL_WRITE            0x0008
+#endif
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS             1034
+#endif
+
+/* Design of the system:
+ *      The arena is a scratch heap over a shared mapping of a memfd (an anonymous file in
+ *      memory) of the capacity of the arena; the file is sparse, only written pages use
+ *      memory. It starts with the same header as a scratch image (see scratch_image.h):
+ *      references between objects are rel_ptrs and the root object is in the header.
+ *      Once built, the arena is frozen: its mapping becomes read-only and the memfd is
+ *      sealed against writes, so that its content never changes.
+ *      A clone is a private (MAP_PRIVATE) mapping of the memfd: it shares the pages of
+ *      the arena until it writes to them, when the kernel copies only the written page.
+ *      A clone is itself a scratch heap and can allocate past the end of the arena.
+ *      The memfd can be passed to other processes, which clone it the same way.
+ *
+ *      arena (shared, sealed)   | A | B | C | D |   ...   |
+ *      clone 1 (private)        | A | B'| C | D |   ...   |   B written by worker 1
+ *      clone 2 (private)        | A | B | C | D | E' |    |   E allocated by worker 2
+ */
+
+struct memfd_arena {
+        struct scratch_heap     scr;
+        size_t                  capacity;
+        int                     fd;
+        int                     frozen;
+};
+
+struct memfd_clone {
+        struct scratch_heap     scr;
+        size_t                  capacity;
+};
+
+int memfd_arena_init(struct memfd_arena *a, const char *name, size_t capacity)
+{
+        capacity = (capacity + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+
+        if (capacity < sizeof(struct scratch_image_header))
+                return -1;
+
+        a->fd = (int)syscall(SYS_memfd_create, name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+        if (a->fd < 0)
+                return -1;
+
+        void *mem = MAP_FAILED;
+
+        if (ftruncate(a->fd, capacity) == 0)
+                mem = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, a->fd, 0);
+
+        if (mem == MAP_FAILED) {
+                close(a->fd);
+                return -1;
+        }
+
+        struct scratch_image_header *hdr = mem;
+
+        hdr->magic = SCRATCH_IMAGE_MAGIC;
+        hdr->nbytes = 0;
+        hdr->root = 0;
+        hdr->reserved = 0;
+
+        a->capacity = capacity;
+        a->frozen = 0;
+        a->scr.mem = mem;
+        a->scr.head = (void *)((uintptr_t)mem + sizeof(struct scratch_image_header));
+        a->scr.tail = (void *)((uintptr_t)mem + capacity);
+
+        return 0;
+}
+
+void *memfd_arena_alloc(struct memfd_arena *a, size_t nbytes, size_t alignment)
+{
+        if (a->frozen || alignment > HEAP_PAGE_SIZE)
+                return NULL;
+
+        return scratch_alloc(&a->scr, nbytes, alignment);
+}
+
+void memfd_arena_set_root(struct memfd_arena *a, const void *root)
+{
+        struct scratch_image_header *hdr = a->scr.mem;
+
+        rel_set(hdr->root, root);
+}
+
+/* make the arena immutable: no more allocations, and writes through any mapping of the
+ * memfd but private clones fail. on failure the arena is left writable, or if that fails
+ * too, full: only memfd_arena_term() may then be called */
+int memfd_arena_freeze(struct memfd_arena *a)
+{
+        struct scratch_image_header *hdr = a->scr.mem;
+
+        if (a->frozen)
+                return 0;
+
+        hdr->nbytes = (uintptr_t)a->scr.head - (uintptr_t)a->scr.mem;
+
+        /* the write seal is refused while a shared mapping may be made writable: replace
+         * ours in place with a mapping of a read-only descriptor of the memfd */
+        char path[32];
+
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", a->fd);
+
+        const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd < 0)
+                return -1;
+
+        void *mem = mmap(a->scr.mem, a->capacity, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0);
+
+        close(fd);
+
+        if (mem == MAP_FAILED)
+                return -1;
+
+        if (fcntl(a->fd, F_ADD_SEALS, F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+                /* not sealed: give the arena its writable mapping back */
+                mem = mmap(a->scr.mem, a->capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, a->fd, 0);
+
+                if (mem == MAP_FAILED)
+                        a->scr.head = a->scr.tail;
+
+                return -1;
+        }
+
+        a->frozen = 1;
+
+        return 0;
+}
+
+/* map fd, the memfd of a frozen arena (possibly of another process), copy-on-write.
+ * fd must be sealed against writes, so that the shared pages never change under the clone */
+int memfd_clone_fd(struct memfd_clone *c, int fd)
+{
+        struct stat st;
+        const int seals = fcntl(fd, F_GET_SEALS);
+
+        if (seals < 0 || !(seals & F_SEAL_WRITE))
+                return -1;
+
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct scratch_image_header))
+                return -1;
+
+        const size_t capacity = st.st_size;
+
+        void *mem = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+        if (mem == MAP_FAILED)
+                return -1;
+
+        struct scratch_image_header *hdr = mem;
+
+        if (hdr->magic != SCRATCH_IMAGE_MAGIC || hdr->nbytes == 0 || hdr->nbytes > capacity) {
+                munmap(mem, capacity);
+                return -1;
+        }
+
+        c->capacity = capacity;
+        c->scr.mem = mem;
+        c->scr.head = (void *)((uintptr_t)mem + hdr->nbytes);
+        c->scr.tail = (void *)((uintptr_t)mem + capacity);
+
+        return 0;
+}
+
+int memfd_arena_clone(struct memfd_arena *a, struct memfd_clone *c)
+{
+        if (!a->frozen)
+                return -1;
+
+        return memfd_clone_fd(c, a->fd);
+}
+
+void *memfd_clone_root(struct memfd_clone *c)
+{
+        struct scratch_image_header *hdr = c->scr.mem;
+
+        return rel_get(void, hdr->root);
+}
+
+/* private allocation in the clone, after the objects of the arena */
+void *memfd_clone_alloc(struct memfd_clone *c, size_t nbytes, size_t alignment)
+{
+        if (alignment > HEAP_PAGE_SIZE)
+                return NULL;
+
+        return scratch_alloc(&c->scr, nbytes, alignment);
+}
+
+void memfd_clone_term(struct memfd_clone *c)
+{
+        if (c == NULL || c->scr.mem == NULL)
+                return;
+
+        munmap(c->scr.mem, c->capacity);
+        c->scr.mem = NULL;
+}
+
+/* the clones stay valid after the arena is terminated */
+void memfd_arena_term(struct memfd_arena *a)
+{
+        if (a == NULL || a->scr.mem == NULL)
+                return;
+
+        munmap(a->scr.mem, a->capacity);
+        close(a->fd);
+        a->scr.mem = NULL;
+}
+
+#endif
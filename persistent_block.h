@@ -0,0 +1,336 @@
+/* persistent_block.h -- Implementation of a crash-consistent file-backed block pool
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef PERSISTENT_BLOCK_H
+#define PERSISTENT_BLOCK_H
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "heap.h"
+#include "bit.h"
+
+#define PBLOCK_MAGIC    0x314b434f4c424250ULL   /* "PBBLOCK1" */
+#define PBLOCK_BITMAP   64
+
+/* Design of the system:
+ *      The pool is a file mapped shared. Its first pages hold a header and the occupancy
+ *      bitmap (one bit per block, set when the block holds a committed object), then come
+ *      the blocks, page aligned:
+ *
+ *      +--------+----------------+----------+----------+-----+
+ *      | header | bitmap         | block 0  | block 1  | ... |
+ *      +--------+----------------+----------+----------+-----+
+ *      0        64               data
+ *
+ *      The bitmap is the only persistent metadata, and it is only changed by single
+ *      aligned 64 bit word writes, each made durable (msync of its page) before the call
+ *      returns. An object is written in two steps, data before metadata:
+ *              pblock_reserve()        takes a block in memory only
+ *              pblock_persist()        the caller writes the object and makes it durable
+ *              pblock_commit()         sets the bit of the block in the file
+ *      A crash before the commit leaves the block free on disk, a crash after it leaves a
+ *      complete object. pblock_free() clears the bit, which is durable on return.
+ *      At open, the free blocks are found from the bitmap: recovery reads the metadata,
+ *      never the data. The header is written last at creation, so that a file whose
+ *      creation did not complete is detected and formatted again.
+ *
+ *      A copy of the bitmap in memory marks the reserved blocks as well as the committed
+ *      ones. The pool is not thread safe.
+ */
+
+struct pblock_header {
+        uint64_t        magic;
+        uint64_t        block_size;
+        uint64_t        nblocks;
+        uint64_t        data;
+};
+
+struct pblock_heap {
+        struct heap     *h;
+        int             fd;
+        void            *mem;
+        size_t          nbytes;
+        size_t          block_size;
+        size_t          nblocks;
+        uint64_t        *bits;          /* committed, in the file */
+        uint64_t        *used;          /* committed or reserved, in memory */
+        size_t          cursor;
+        size_t          nfree;
+};
+
+size_t pblock_nwords(size_t nblocks)
+{
+        return (nblocks + 63) / 64;
+}
+
+/* flush the pages holding [ptr, ptr + nbytes) to the file */
+int pblock_sync(const void *ptr, size_t nbytes)
+{
+        const uintptr_t start = (uintptr_t)ptr & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+        const uintptr_t end = (uintptr_t)ptr + nbytes;
+
+        return msync((void *)start, end - start, MS_SYNC);
+}
+
+void *pblock_ptr(struct pblock_heap *p, size_t index)
+{
+        const struct pblock_header *hdr = p->mem;
+
+        return (char *)p->mem + hdr->data + (index * p->block_size);
+}
+
+long pblock_index(struct pblock_heap *p, const void *ptr)
+{
+        const struct pblock_header *hdr = p->mem;
+        const uintptr_t base = (uintptr_t)p->mem + hdr->data;
+        const uintptr_t offset = (uintptr_t)ptr - base;
+
+        if ((uintptr_t)ptr < base || offset % p->block_size != 0 || offset / p->block_size >= p->nblocks)
+                return -1;
+
+        return (long)(offset / p->block_size);
+}
+
+/* bytes of a pool of nblocks blocks of block_size bytes starting at data, 0 if the
+ * geometry is invalid or its size overflows */
+size_t pblock_file_size(uint64_t data, uint64_t block_size, uint64_t nblocks)
+{
+        uint64_t nbytes;
+
+        if (block_size == 0 || nblocks == 0 || nblocks > SIZE_MAX - 63)
+                return 0;
+        if (data < PBLOCK_BITMAP + pblock_nwords(nblocks) * sizeof(uint64_t))
+                return 0;
+        if (__builtin_mul_overflow(block_size, nblocks, &nbytes) || __builtin_add_overflow(nbytes, data, &nbytes))
+                return 0;
+        if (nbytes > SIZE_MAX || nbytes > (uint64_t)INT64_MAX)
+                return 0;
+
+        return (size_t)nbytes;
+}
+
+/* open the pool stored in the file at path, creating it with nblocks blocks of
+ * block_size bytes if it does not exist. an existing pool keeps its geometry */
+int pblock_open(struct pblock_heap *p, struct heap *h, const char *path, size_t block_size, size_t nblocks)
+{
+        struct stat st;
+        struct pblock_header hdr;
+
+        p->h = h;
+        p->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+        if (p->fd < 0)
+                return -1;
+
+        if (fstat(p->fd, &st) != 0)
+                goto fail;
+
+        /* an existing and complete pool */
+        if ((size_t)st.st_size >= sizeof(hdr) && pread(p->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            hdr.magic == PBLOCK_MAGIC) {
+                block_size = hdr.block_size;
+                nblocks = hdr.nblocks;
+
+                /* a corrupt header or a truncated file would be mapped past its end */
+                const size_t nbytes = pblock_file_size(hdr.data, block_size, nblocks);
+
+                if (nbytes == 0 || (uint64_t)st.st_size < nbytes) {
+                        if (h->hft & HEAP_DEBUG)
+                                printf("pblock info: %s has a corrupt header or is truncated\n", path);
+                        goto fail;
+                }
+        } else {
+                if (block_size == 0 || nblocks == 0)
+                        goto fail;
+
+                hdr.magic = 0;
+                hdr.block_size = block_size;
+                hdr.nblocks = nblocks;
+                hdr.data = (PBLOCK_BITMAP + pblock_nwords(nblocks) * sizeof(uint64_t) + HEAP_PAGE_SIZE - 1) &
+                           ~(uint64_t)(HEAP_PAGE_SIZE - 1);
+
+                if (pblock_file_size(hdr.data, block_size, nblocks) == 0)
+                        goto fail;
+
+                /* a zeroed bitmap, the header without its magic, then the magic */
+                if (ftruncate(p->fd, 0) != 0 || ftruncate(p->fd, hdr.data + (block_size * nblocks)) != 0)
+                        goto fail;
+                if (pwrite(p->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || fsync(p->fd) != 0)
+                        goto fail;
+
+                hdr.magic = PBLOCK_MAGIC;
+
+                if (pwrite(p->fd, &hdr.magic, sizeof(hdr.magic), 0) != sizeof(hdr.magic) || fsync(p->fd) != 0)
+                        goto fail;
+        }
+
+        p->block_size = block_size;
+        p->nblocks = nblocks;
+        p->nbytes = hdr.data + (block_size * nblocks);
+        p->mem = mmap(NULL, p->nbytes, PROT_READ | PROT_WRITE, MAP_SHARED, p->fd, 0);
+
+        if (p->mem == MAP_FAILED)
+                goto fail;
+
+        p->bits = (uint64_t *)((char *)p->mem + PBLOCK_BITMAP);
+        p->used = heap_alloc(h, pblock_nwords(nblocks) * sizeof(uint64_t));
+
+        if (p->used == NULL) {
+                munmap(p->mem, p->nbytes);
+                goto fail;
+        }
+
+        /* recovery: the free blocks are the clear bits */
+        memcpy(p->used, p->bits, pblock_nwords(nblocks) * sizeof(uint64_t));
+        p->cursor = 0;
+        p->nfree = 0;
+
+        for (size_t i = 0; i < nblocks; i++)
+                p->nfree += !bit64_check(p->used, i);
+
+        return 0;
+
+fail:
+        close(p->fd);
+        return -1;
+}
+
+/* take a free block, in memory only. NULL if the pool is full */
+void *pblock_reserve(struct pblock_heap *p)
+{
+        const size_t nwords = pblock_nwords(p->nblocks);
+
+        if (p->nfree == 0)
+                return NULL;
+
+        for (size_t n = 0; n < nwords; n++) {
+                const size_t w = (p->cursor + n) % nwords;
+                const uint64_t word = ~p->used[w];
+
+                if (word == 0)
+                        continue;
+
+                const size_t index = (w * 64) + trailing_zeros_count64(word);
+
+                if (index >= p->nblocks)
+                        continue;
+
+                bit64_set(p->used, index);
+                p->cursor = w;
+                p->nfree--;
+
+                return pblock_ptr(p, index);
+        }
+
+        return NULL;
+}
+
+/* make the first nbytes of an object durable */
+int pblock_persist(struct pblock_heap *p, const void *ptr, size_t nbytes)
+{
+        if (pblock_index(p, ptr) == -1 || nbytes > p->block_size)
+                return -1;
+
+        return pblock_sync(ptr, nbytes);
+}
+
+/* set the bit of a reserved block in the file. the object must be persisted first */
+int pblock_commit(struct pblock_heap *p, const void *ptr)
+{
+        const long index = pblock_index(p, ptr);
+
+        if (index == -1 || !bit64_check(p->used, index))
+                return -1;
+
+        uint64_t *word = &p->bits[index / 64];
+
+        __atomic_or_fetch(word, bit64(index % 64), __ATOMIC_RELEASE);
+
+        return pblock_sync(word, sizeof(uint64_t));
+}
+
+int pblock_is_committed(struct pblock_heap *p, const void *ptr)
+{
+        const long index = pblock_index(p, ptr);
+
+        return (index != -1 && bit64_check(p->bits, index)) ? 1 : 0;
+}
+
+/* free a reserved or committed block. a commit is undone durably */
+int pblock_free(struct pblock_heap *p, void *ptr)
+{
+        const long index = pblock_index(p, ptr);
+
+        if (index == -1 || !bit64_check(p->used, index))
+                return -1;
+
+        if (bit64_check(p->bits, index)) {
+                uint64_t *word = &p->bits[index / 64];
+
+                __atomic_and_fetch(word, ~bit64(index % 64), __ATOMIC_RELEASE);
+
+                if (pblock_sync(word, sizeof(uint64_t)) != 0)
+                        return -1;
+        }
+
+        bit64_clear(p->used, index);
+        p->nfree++;
+
+        return 0;
+}
+
+/* first committed block at or after index from, -1 if none: walks the objects of the
+ * pool after a restart */
+long pblock_next(struct pblock_heap *p, size_t from)
+{
+        for (size_t w = from / 64; w < pblock_nwords(p->nblocks); w++) {
+                uint64_t word = p->bits[w];
+
+                if (w == from / 64)
+                        word &= ~(uint64_t)0 << (from % 64);
+
+                if (word != 0) {
+                        const size_t index = (w * 64) + trailing_zeros_count64(word);
+
+                        return (index < p->nblocks) ? (long)index : -1;
+                }
+        }
+
+        return -1;
+}
+
+void pblock_close(struct pblock_heap *p)
+{
+        if (p == NULL || p->mem == NULL)
+                return;
+
+        munmap(p->mem, p->nbytes);
+        close(p->fd);
+        heap_free(p->h, p->used);
+        p->mem = NULL;
+}
+
+#endif
@@ -0,0 +1,41 @@
+/* rel_ptr.h - self-relative pointers, valid wherever the memory holding them is mapped */
+
+#ifndef REL_PTR_H
+#define REL_PTR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A rel_ptr holds the distance from its own address to its target, 0 for NULL. A
+ * structure of rel_ptrs pointing inside the same region stays valid when the region is
+ * copied, written to a file and mapped back, or mapped at another address.
+ * A distance of 0 (a rel_ptr pointing to itself, or to the start of the structure it
+ * begins) would read back as NULL: distances of 0 and more are stored plus one, so that
+ * only NULL encodes as 0 and zeroed memory still holds NULL rel_ptrs. */
+
+typedef int64_t rel_ptr;
+
+#define rel_get(T, rp)          ((T *)rel_ptr_get(&(rp)))
+#define rel_set(rp, target)     rel_ptr_set(&(rp), (target))
+
+void rel_ptr_set(rel_ptr *rp, const void *target)
+{
+        if (target == NULL) {
+                *rp = 0;
+                return;
+        }
+
+        const int64_t d = (int64_t)((intptr_t)target - (intptr_t)rp);
+
+        *rp = (d >= 0) ? d + 1 : d;
+}
+
+void *rel_ptr_get(const rel_ptr *rp)
+{
+        if (*rp == 0)
+                return NULL;
+
+        return (void *)((intptr_t)rp + ((*rp > 0) ? *rp - 1 : *rp));
+}
+
+#endif
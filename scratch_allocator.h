@@ -32,6 +32,36 @@ struct scratch_heap {
         void *mem;
 };
 
+/* A scratch chain links scratch heaps (chunks) together. When the current chunk is full
+ * a new chunk is pushed at the front of the chain, so allocations never move and the
+ * arena grows without bound. Chunks are released all at once by reset or term.
+ *
+ *      chunks -> [current] -> [full] -> [full] -> NULL
+ *
+ * The heap of a chain whose chunks are allocated or freed by several threads (detached
+ * chunks freed elsewhere, the tasks of task_arena.h) must not count its allocations
+ * (HEAP_COUNT): the counter is not atomic.
+ */
+struct scratch_chunk {
+        struct scratch_chunk    *next;
+        struct scratch_heap     scr;
+};
+
+struct scratch_chain {
+        struct heap             *h;
+        size_t                  chunk_size;
+        size_t                  alignment;
+        struct scratch_chunk    *chunks;
+};
+
+/* The chunks taken out of a chain by scratch_detach(). The object is moved (copied by
+ * value) to another thread, which owns the data and releases it with
+ * scratch_attach_free(). */
+struct scratch_detached {
+        struct heap             *h;
+        struct scratch_chunk    *chunks;
+};
+
 void scratch_heap_init(struct scratch_heap *scr, struct heap *h, size_t nbytes, size_t alignment) 
 {
         if (nbytes == 0)
@@ -48,24 +78,47 @@ void scratch_heap_init(struct scratch_heap *scr, struct heap *h, size_t nbytes,
 
 void *scratch_alloc(struct scratch_heap *scr, size_t nbytes, size_t alignment) 
 {
-        void *ptr_0, *ptr_1;
-
         if (alignment == 0 || (alignment & (alignment - 1)) != 0)
                 return NULL;
         
-        const size_t alloc = ((uintptr_t)scr->head % alignment == 0) ? nbytes : (nbytes + alignment - 1);
+        /* the head ends exactly at the end of the allocation, see scratch_realloc() */
+        const uintptr_t base = ((uintptr_t)scr->head + alignment - 1) & ~(alignment - 1);
 
-        if ((void*)((uintptr_t)scr->head + alloc) > scr->tail) 
+        if (base > (uintptr_t)scr->tail || nbytes > (uintptr_t)scr->tail - base) 
                 return NULL;
         
-        ptr_0 = scr->head;
-        scr->head = (void *)((uintptr_t)scr->head + alloc);
+        scr->head = (void *)(base + nbytes);
 
-        if (alloc > nbytes) {
-                ptr_0 = (void*)(((uintptr_t)ptr_0 + (alignment - 1)) & ~(alignment - 1));
+        return (void *)base;
+}
+
+/* scratch_alloc() with per allocation flags (see enum alloc_flag) */
+void *scratch_alloc_flags(struct scratch_heap *scr, size_t nbytes, size_t alignment, const unsigned flags)
+{
+        return alloc_vtail_clear(scratch_alloc(scr, nbytes + alloc_vtail_size(flags), alignment), nbytes, flags);
+}
+
+/* grow or shrink an allocation. the top allocation of the arena is resized in place,
+ * any other allocation is copied to a new location (the old one is not reclaimed). */
+void *scratch_realloc(struct scratch_heap *scr, void *ptr, size_t old_nbytes, size_t nbytes, size_t alignment)
+{
+        if (ptr == NULL)
+                return scratch_alloc(scr, nbytes, alignment);
+
+        if ((void *)((uintptr_t)ptr + old_nbytes) == scr->head) {
+                if ((void *)((uintptr_t)ptr + nbytes) > scr->tail)
+                        return NULL;
+
+                scr->head = (void *)((uintptr_t)ptr + nbytes);
+                return ptr;
         }
-        
-        return ptr_0;
+
+        void *new = scratch_alloc(scr, nbytes, alignment);
+
+        if (new != NULL)
+                memcpy(new, ptr, (old_nbytes < nbytes) ? old_nbytes : nbytes);
+
+        return new;
 }
 
 void scratch_heap_term(struct scratch_heap *scr, struct heap *h) 
@@ -84,4 +137,132 @@ void scratch_heap_reset(struct scratch_heap *scr)
         scr->head = scr->mem;
 }
 
+struct scratch_chunk *scratch_chunk_new(struct heap *h, size_t nbytes, size_t alignment)
+{
+        struct scratch_chunk *c = heap_alloc(h, sizeof(struct scratch_chunk));
+
+        if (c == NULL)
+                return NULL;
+
+        /* keep the size a multiple of the alignment, see heap_aligned_alloc() */
+        nbytes = (nbytes + alignment - 1) & ~(alignment - 1);
+        c->scr.mem = NULL;
+        c->next = NULL;
+
+        scratch_heap_init(&c->scr, h, nbytes, alignment);
+
+        if (c->scr.mem == NULL) {
+                heap_free(h, c);
+                return NULL;
+        }
+
+        return c;
+}
+
+void scratch_chunk_free(struct heap *h, struct scratch_chunk *c)
+{
+        scratch_heap_term(&c->scr, h);
+        heap_free(h, c);
+}
+
+int scratch_chain_init(struct scratch_chain *chn, struct heap *h, size_t chunk_size, size_t alignment)
+{
+        if (chunk_size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+                return -1;
+
+        chn->h = h;
+        chn->chunk_size = chunk_size;
+        chn->alignment = alignment;
+        chn->chunks = scratch_chunk_new(h, chunk_size, alignment);
+
+        return (chn->chunks == NULL) ? -1 : 0;
+}
+
+void *scratch_chain_alloc(struct scratch_chain *chn, size_t nbytes, size_t alignment)
+{
+        void *ptr = NULL;
+
+        if (chn->chunks != NULL)
+                ptr = scratch_alloc(&chn->chunks->scr, nbytes, alignment);
+
+        if (ptr != NULL)
+                return ptr;
+
+        /* requests larger than a chunk get a chunk of their own */
+        size_t nchunk = nbytes + alignment;
+
+        if (nchunk < chn->chunk_size)
+                nchunk = chn->chunk_size;
+
+        struct scratch_chunk *c = scratch_chunk_new(chn->h, nchunk, chn->alignment);
+
+        if (c == NULL)
+                return NULL;
+
+        c->next = chn->chunks;
+        chn->chunks = c;
+
+        return scratch_alloc(&c->scr, nbytes, alignment);
+}
+
+/* release every chunk but the current one, which is rewound */
+void scratch_chain_reset(struct scratch_chain *chn)
+{
+        if (chn == NULL || chn->chunks == NULL)
+                return;
+
+        struct scratch_chunk *c = chn->chunks->next;
+
+        while (c != NULL) {
+                struct scratch_chunk *next = c->next;
+
+                scratch_chunk_free(chn->h, c);
+                c = next;
+        }
+
+        chn->chunks->next = NULL;
+        scratch_heap_reset(&chn->chunks->scr);
+}
+
+/* take every chunk out of the chain, which continues with a fresh chunk. nothing is
+ * copied: the allocations stay valid until scratch_attach_free(). returns -1 (and the
+ * chain is unchanged) if the fresh chunk cannot be allocated */
+int scratch_detach(struct scratch_chain *chn, struct scratch_detached *d)
+{
+        struct scratch_chunk *c = scratch_chunk_new(chn->h, chn->chunk_size, chn->alignment);
+
+        if (c == NULL)
+                return -1;
+
+        d->h = chn->h;
+        d->chunks = chn->chunks;
+        chn->chunks = c;
+
+        return 0;
+}
+
+/* release detached chunks, on any thread (see above for the heap of the chain) */
+void scratch_attach_free(struct scratch_detached *d)
+{
+        while (d->chunks != NULL) {
+                struct scratch_chunk *next = d->chunks->next;
+
+                scratch_chunk_free(d->h, d->chunks);
+                d->chunks = next;
+        }
+}
+
+void scratch_chain_term(struct scratch_chain *chn)
+{
+        if (chn == NULL)
+                return;
+
+        while (chn->chunks != NULL) {
+                struct scratch_chunk *next = chn->chunks->next;
+
+                scratch_chunk_free(chn->h, chn->chunks);
+                chn->chunks = next;
+        }
+}
+
 #endif
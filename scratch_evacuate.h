@@ -0,0 +1,258 @@
+/* scratch_evacuate.h -- Semi-space evacuation of the live objects of a scratch chain
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SCRATCH_EVACUATE_H
+#define SCRATCH_EVACUATE_H
+
+#include "heap.h"
+#include "scratch_allocator.h"
+#include "arena_containers.h"
+
+/* Design of the system:
+ *      A long-lived scratch chain (see scratch_allocator.h) cannot be reset while it holds
+ *      a few live objects among mostly dead ones. scratch_evacuate() copies the live
+ *      objects into a fresh chain (to-space) and drops the old chunks (from-space) in
+ *      bulk, like a semi-space collector:
+ *
+ *      from-space:  [ a | dead | b | dead ] -> [ dead | c | dead ] -> NULL    released
+ *      to-space:    [ a | b | c | free ] -> NULL                              kept
+ *
+ *      The scratch chain has no object header: the caller describes the objects.
+ *              roots()         is called once and reports every root slot (a pointer
+ *                              outside of the arena to an object of the arena) with
+ *                              scratch_relocate(slot, nbytes, alignment).
+ *              trace()         is called once on each copied object (optional) and
+ *                              reports the slots of the object pointing into the arena,
+ *                              with scratch_relocate() as well.
+ *
+ *      scratch_relocate() copies the object on its first report and rewrites the slot to
+ *      the copy. A forwarding table (from address -> copy) keeps shared objects shared;
+ *      the copies wait in a FIFO until traced (Cheney order, no recursion). The table, the
+ *      FIFO and an undo log of the rewritten slots live in a temporary chain released at
+ *      the end. If an allocation fails the slots are restored and the arena is unchanged.
+ *
+ *      Slots must point to the start of an allocation of the arena, or be NULL (ignored).
+ */
+
+#define SCRATCH_EVAC_CHUNK 4096
+#define SCRATCH_EVAC_MIN_TABLE 64
+
+struct scratch_fwd {
+        uintptr_t               from;
+        void                    *to;
+        size_t                  nbytes;
+        struct scratch_fwd      *next;
+};
+
+struct scratch_undo {
+        void                    **slot;
+        void                    *old;
+        struct scratch_undo     *next;
+};
+
+struct scratch_evac {
+        struct scratch_chain    to;
+        struct scratch_chain    tmp;
+        struct scratch_fwd      **table;
+        size_t                  cap;
+        size_t                  len;
+        struct scratch_fwd      *scan;
+        struct scratch_fwd      *last;
+        struct scratch_undo     *undo;
+        size_t                  nobjects;
+        size_t                  nbytes;
+        int                     failed;
+};
+
+typedef void (*scratch_roots_fn)(struct scratch_evac *ev, void *ctx);
+typedef void (*scratch_trace_fn)(struct scratch_evac *ev, void *obj, size_t nbytes, void *ctx);
+
+struct scratch_fwd **scratch_fwd_slot(struct scratch_fwd **table, size_t cap, uintptr_t from)
+{
+        size_t i = arena_hash64(from) & (cap - 1);
+
+        while (table[i] != NULL && table[i]->from != from)
+                i = (i + 1) & (cap - 1);
+
+        return &table[i];
+}
+
+/* the old table is left in the temporary chain */
+int scratch_fwd_grow(struct scratch_evac *ev)
+{
+        const size_t cap = (ev->cap == 0) ? SCRATCH_EVAC_MIN_TABLE : ev->cap * 2;
+        struct scratch_fwd **table = scratch_chain_alloc(&ev->tmp, cap * sizeof(*table), _Alignof(struct scratch_fwd *));
+
+        if (table == NULL)
+                return -1;
+
+        memset(table, 0, cap * sizeof(*table));
+
+        for (size_t i = 0; i < ev->cap; i++) {
+                if (ev->table[i] != NULL)
+                        *scratch_fwd_slot(table, cap, ev->table[i]->from) = ev->table[i];
+        }
+
+        ev->table = table;
+        ev->cap = cap;
+
+        return 0;
+}
+
+int scratch_fwd_put(struct scratch_evac *ev, struct scratch_fwd *f)
+{
+        if ((ev->len + 1) * 4 > ev->cap * 3 && scratch_fwd_grow(ev) != 0)
+                return -1;
+
+        *scratch_fwd_slot(ev->table, ev->cap, f->from) = f;
+        ev->len++;
+
+        return 0;
+}
+
+/* copy the object *slot points to (once), and rewrite the slot to the copy. alignment 0
+ * is the alignment of the chain */
+void scratch_relocate(struct scratch_evac *ev, void **slot, size_t nbytes, size_t alignment)
+{
+        void *ptr = *slot;
+
+        if (ev->failed || ptr == NULL)
+                return;
+
+        if (alignment == 0)
+                alignment = ev->to.alignment;
+
+        struct scratch_fwd **s = scratch_fwd_slot(ev->table, ev->cap, (uintptr_t)ptr);
+        struct scratch_fwd *f = *s;
+
+        /* already a copy: the slot was reported twice */
+        if (f != NULL && f->to == ptr)
+                return;
+
+        struct scratch_undo *u = scratch_chain_alloc(&ev->tmp, sizeof(*u), _Alignof(struct scratch_undo));
+
+        if (u == NULL)
+                goto fail;
+
+        if (f == NULL) {
+                struct scratch_fwd *back;
+
+                f = scratch_chain_alloc(&ev->tmp, sizeof(*f), _Alignof(struct scratch_fwd));
+                back = scratch_chain_alloc(&ev->tmp, sizeof(*back), _Alignof(struct scratch_fwd));
+
+                if (f == NULL || back == NULL)
+                        goto fail;
+
+                f->from = (uintptr_t)ptr;
+                f->to = scratch_chain_alloc(&ev->to, nbytes, alignment);
+                f->nbytes = nbytes;
+                f->next = NULL;
+
+                if (f->to == NULL)
+                        goto fail;
+
+                /* the copy is a key too, for slots reported twice */
+                back->from = (uintptr_t)f->to;
+                back->to = f->to;
+                back->nbytes = nbytes;
+                back->next = NULL;
+
+                if (scratch_fwd_put(ev, f) != 0 || scratch_fwd_put(ev, back) != 0)
+                        goto fail;
+
+                memcpy(f->to, ptr, nbytes);
+                ev->nobjects++;
+                ev->nbytes += nbytes;
+
+                if (ev->last != NULL)
+                        ev->last->next = f;
+                else
+                        ev->scan = f;
+
+                ev->last = f;
+        }
+
+        u->slot = slot;
+        u->old = ptr;
+        u->next = ev->undo;
+        ev->undo = u;
+
+        *slot = f->to;
+        return;
+
+fail:
+        ev->failed = 1;
+}
+
+/* move the live objects of chn to a fresh chain and release the old chunks. returns -1
+ * (and chn and the slots are unchanged) if memory runs out */
+int scratch_evacuate(struct scratch_chain *chn, scratch_roots_fn roots, scratch_trace_fn trace, void *ctx)
+{
+        struct scratch_evac ev = {0};
+
+        if (scratch_chain_init(&ev.to, chn->h, chn->chunk_size, chn->alignment) != 0)
+                return -1;
+
+        if (scratch_chain_init(&ev.tmp, chn->h, SCRATCH_EVAC_CHUNK, _Alignof(struct scratch_fwd)) != 0
+            || scratch_fwd_grow(&ev) != 0) {
+                scratch_chain_term(&ev.tmp);
+                scratch_chain_term(&ev.to);
+                return -1;
+        }
+
+        roots(&ev, ctx);
+
+        while (ev.scan != NULL && !ev.failed) {
+                struct scratch_fwd *f = ev.scan;
+
+                if (trace != NULL)
+                        trace(&ev, f->to, f->nbytes, ctx);
+
+                /* read after the trace, which may have queued copies behind f */
+                ev.scan = f->next;
+        }
+
+        if (ev.failed) {
+                /* newest first: a slot rewritten twice gets its first value back */
+                for (struct scratch_undo *u = ev.undo; u != NULL; u = u->next)
+                        *u->slot = u->old;
+
+                if (chn->h->hft & HEAP_DEBUG)
+                        printf("scratch_evacuate info: out of memory, arena unchanged\n");
+
+                scratch_chain_term(&ev.tmp);
+                scratch_chain_term(&ev.to);
+                return -1;
+        }
+
+        if (chn->h->hft & HEAP_DEBUG)
+                printf("scratch_evacuate info: %zu objects (%zu bytes) evacuated\n", ev.nobjects, ev.nbytes);
+
+        scratch_chain_term(&ev.tmp);
+        scratch_chain_term(chn);
+        chn->chunks = ev.to.chunks;
+
+        return 0;
+}
+
+#endif
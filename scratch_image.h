@@ -0,0 +1,194 @@
+/* scratch_image.h -- Scratch arena stored as a relocatable image, loaded back with mmap
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SCRATCH_IMAGE_H
+#define SCRATCH_IMAGE_H
+
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "heap.h"
+#include "scratch_allocator.h"
+#include "rel_ptr.h"
+
+#define SCRATCH_IMAGE_MAGIC     0x32474d4948435253ULL   /* "SRCHIMG2" */
+
+/* Design of the system:
+ *      The arena is a single scratch heap over a range of virtual memory reserved once
+ *      (MAP_NORESERVE): it never moves and its pages are only backed once touched. The
+ *      first bytes hold a header with the size of the image and a rel_ptr to the root
+ *      object. References between objects of the arena are rel_ptrs (see rel_ptr.h), so
+ *      the image does not depend on the address it is mapped at.
+ *
+ *      +--------+---------------------------------+------------------------+
+ *      | header | objects (rel_ptr to each other) |   reserved, untouched  |
+ *      +--------+---------------------------------+------------------------+
+ *      ^ mem     \___ root                        ^ head                   ^ tail
+ *
+ *      scratch_image_write() writes the bytes up to head to a file descriptor.
+ *      scratch_image_load() maps a file back (MAP_PRIVATE): the objects are used in
+ *      place, with no parsing and no copy; pages are read from the page cache on demand.
+ *      A loaded image is full, it takes no new allocations.
+ */
+
+struct scratch_image_header {
+        uint64_t        magic;
+        uint64_t        nbytes;
+        rel_ptr         root;
+        uint64_t        reserved;
+};
+
+struct scratch_image {
+        struct scratch_heap     scr;
+        size_t                  capacity;
+};
+
+/* reserve capacity bytes of address space for the image */
+int scratch_image_init(struct scratch_image *img, size_t capacity)
+{
+        capacity = (capacity + HEAP_PAGE_SIZE - 1) & ~(size_t)(HEAP_PAGE_SIZE - 1);
+
+        if (capacity < sizeof(struct scratch_image_header))
+                return -1;
+
+        void *mem = mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (mem == MAP_FAILED)
+                return -1;
+
+        img->capacity = capacity;
+        img->scr.mem = mem;
+        img->scr.head = (void *)((uintptr_t)mem + sizeof(struct scratch_image_header));
+        img->scr.tail = (void *)((uintptr_t)mem + capacity);
+
+        struct scratch_image_header *hdr = mem;
+
+        hdr->magic = SCRATCH_IMAGE_MAGIC;
+        hdr->nbytes = 0;
+        hdr->root = 0;
+        hdr->reserved = 0;
+
+        return 0;
+}
+
+/* the alignment is kept by the image as long as it is at most HEAP_PAGE_SIZE */
+void *scratch_image_alloc(struct scratch_image *img, size_t nbytes, size_t alignment)
+{
+        if (alignment > HEAP_PAGE_SIZE)
+                return NULL;
+
+        return scratch_alloc(&img->scr, nbytes, alignment);
+}
+
+void scratch_image_set_root(struct scratch_image *img, const void *root)
+{
+        struct scratch_image_header *hdr = img->scr.mem;
+
+        rel_set(hdr->root, root);
+}
+
+void *scratch_image_root(const struct scratch_image *img)
+{
+        struct scratch_image_header *hdr = img->scr.mem;
+
+        return rel_get(void, hdr->root);
+}
+
+size_t scratch_image_size(const struct scratch_image *img)
+{
+        return (uintptr_t)img->scr.head - (uintptr_t)img->scr.mem;
+}
+
+int scratch_image_write(struct scratch_image *img, int fd)
+{
+        struct scratch_image_header *hdr = img->scr.mem;
+        const size_t nbytes = scratch_image_size(img);
+
+        hdr->nbytes = nbytes;
+
+        for (size_t off = 0; off < nbytes;) {
+                const ssize_t n = write(fd, (char *)img->scr.mem + off, nbytes - off);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0)
+                        return -1;
+
+                off += n;
+        }
+
+        return 0;
+}
+
+/* map the image written to the file at path. the pages are private copy-on-write:
+ * the objects may be modified in memory, the file is not */
+int scratch_image_load(struct scratch_image *img, const char *path)
+{
+        struct stat st;
+        const int fd = open(path, O_RDONLY);
+
+        if (fd < 0)
+                return -1;
+
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct scratch_image_header)) {
+                close(fd);
+                return -1;
+        }
+
+        void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+        close(fd);
+
+        if (mem == MAP_FAILED)
+                return -1;
+
+        struct scratch_image_header *hdr = mem;
+
+        if (hdr->magic != SCRATCH_IMAGE_MAGIC || hdr->nbytes != (uint64_t)st.st_size) {
+                munmap(mem, st.st_size);
+                return -1;
+        }
+
+        img->capacity = st.st_size;
+        img->scr.mem = mem;
+        img->scr.head = (void *)((uintptr_t)mem + st.st_size);
+        img->scr.tail = img->scr.head;
+
+        return 0;
+}
+
+void scratch_image_term(struct scratch_image *img)
+{
+        if (img == NULL || img->scr.mem == NULL)
+                return;
+
+        munmap(img->scr.mem, img->capacity);
+        img->scr.mem = NULL;
+}
+
+#endif
@@ -0,0 +1,340 @@
+/* shm_block.h -- Implementation of a fixed-size block pool shared between processes
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SHM_BLOCK_H
+#define SHM_BLOCK_H
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "heap.h"
+
+enum shm_block_limits {
+        SHM_MAX_PROCS = 16,
+        SHM_RING_SIZE = 256
+};
+
+#define SHM_BLOCK_MAGIC 0x314b4c424d485353ULL   /* "SSHMBLK1" */
+#define SHM_NIL         0xffffffffU
+
+/* Design of the system:
+ *      The pool lives in a memfd mapped shared by every process, inherited across fork or
+ *      passed as a file descriptor. Since the segment is mapped at a different address in
+ *      each process, blocks are named by their index and every link is an index.
+ *
+ *      +--------+-------------+------------------------+----------+----------+-----+
+ *      | header | next[nblks] | rings[2][nprocs][nprocs] | block 0  | block 1  | ... |
+ *      +--------+-------------+------------------------+----------+----------+-----+
+ *
+ *      Free blocks form a stack linked through next[]. Its top is a 64 bit word holding
+ *      the index of the top block and a tag incremented by every change, so that any
+ *      number of processes push and pop with a compare-and-swap, without ABA problem.
+ *      Each ordered pair of processes (i, j) has two single-producer single-consumer
+ *      rings of block indexes:
+ *              send[i][j]      messages from i to j
+ *              ret[i][j]       blocks received by i and given back to j, their sender
+ *      A sender allocates a block, writes the message in place and sends its index; the
+ *      receiver reads the message in place and gives the block back to the sender, which
+ *      reuses it before touching the shared stack: no copy and no shared contention in
+ *      the steady state. Processes are numbered from 0 to nprocs - 1 by the caller.
+ */
+
+struct shm_ring {
+        uint32_t        head;
+        char            pad0[60];
+        uint32_t        tail;
+        char            pad1[60];
+        uint32_t        slots[SHM_RING_SIZE];
+};
+
+struct shm_block_header {
+        uint64_t        magic;
+        uint64_t        block_size;
+        uint64_t        nblocks;
+        uint64_t        nprocs;
+        uint64_t        rings;
+        uint64_t        data;
+        uint64_t        nbytes;
+        char            pad[8];
+        uint64_t        top;
+};
+
+struct shm_block_pool {
+        struct shm_block_header *hdr;
+        uint32_t                *next;
+        struct shm_ring         *rings;
+        char                    *data;
+        size_t                  nbytes;
+        int                     fd;
+};
+
+uint32_t shm_tag(uint64_t top)
+{
+        return (uint32_t)(top >> 32);
+}
+
+uint32_t shm_top_index(uint64_t top)
+{
+        return (uint32_t)top;
+}
+
+uint64_t shm_make_top(uint32_t tag, uint32_t index)
+{
+        return ((uint64_t)tag << 32) | index;
+}
+
+/* offsets of the rings and the blocks of a pool, and its size. 0 if the geometry is
+ * invalid or its size overflows */
+size_t shm_block_layout(uint64_t block_size, uint64_t nblocks, uint64_t nprocs, size_t *rings, size_t *data)
+{
+        size_t nbytes;
+
+        if (block_size == 0 || nblocks == 0 || nblocks >= SHM_NIL || nprocs == 0 || nprocs > SHM_MAX_PROCS)
+                return 0;
+
+        *rings = (sizeof(struct shm_block_header) + nblocks * sizeof(uint32_t) + 63) & ~(size_t)63;
+        *data = (*rings + 2 * nprocs * nprocs * sizeof(struct shm_ring) + HEAP_PAGE_SIZE - 1) &
+                ~(size_t)(HEAP_PAGE_SIZE - 1);
+
+        if (__builtin_mul_overflow(block_size, nblocks, &nbytes) || __builtin_add_overflow(nbytes, *data, &nbytes))
+                return 0;
+        if (nbytes > (size_t)INT64_MAX)
+                return 0;
+
+        return nbytes;
+}
+
+int shm_block_map(struct shm_block_pool *p, int fd)
+{
+        struct stat st;
+
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct shm_block_header))
+                return -1;
+
+        void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if (mem == MAP_FAILED)
+                return -1;
+
+        p->fd = fd;
+        p->nbytes = st.st_size;
+        p->hdr = mem;
+        p->next = (uint32_t *)((char *)mem + sizeof(struct shm_block_header));
+        p->rings = (struct shm_ring *)((char *)mem + p->hdr->rings);
+        p->data = (char *)mem + p->hdr->data;
+
+        return 0;
+}
+
+/* create a pool of nblocks blocks of block_size bytes for nprocs processes */
+int shm_block_create(struct shm_block_pool *p, const char *name, size_t block_size, uint32_t nblocks, unsigned nprocs)
+{
+        size_t rings, data;
+        const size_t nbytes = shm_block_layout(block_size, nblocks, nprocs, &rings, &data);
+
+        if (nbytes == 0)
+                return -1;
+
+        const int fd = (int)syscall(SYS_memfd_create, name, 0);
+
+        if (fd < 0)
+                return -1;
+
+        if (ftruncate(fd, nbytes) != 0 || shm_block_map(p, fd) != 0) {
+                close(fd);
+                return -1;
+        }
+
+        /* the memfd is zero-filled: empty rings */
+        p->hdr->block_size = block_size;
+        p->hdr->nblocks = nblocks;
+        p->hdr->nprocs = nprocs;
+        p->hdr->rings = rings;
+        p->hdr->data = data;
+        p->hdr->nbytes = nbytes;
+        p->rings = (struct shm_ring *)((char *)p->hdr + rings);
+        p->data = (char *)p->hdr + data;
+
+        for (uint32_t i = 0; i < nblocks; i++)
+                p->next[i] = (i + 1 < nblocks) ? i + 1 : SHM_NIL;
+
+        p->hdr->top = shm_make_top(0, 0);
+        __atomic_store_n(&p->hdr->magic, SHM_BLOCK_MAGIC, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+/* map the pool of fd, created by another process */
+int shm_block_attach(struct shm_block_pool *p, int fd)
+{
+        if (shm_block_map(p, fd) != 0)
+                return -1;
+
+        const struct shm_block_header *hdr = p->hdr;
+        size_t rings, data;
+
+        if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != SHM_BLOCK_MAGIC)
+                goto fail;
+
+        /* the offsets come from another process: they must match the geometry, and the
+         * blocks must lie inside the segment */
+        const size_t nbytes = shm_block_layout(hdr->block_size, hdr->nblocks, hdr->nprocs, &rings, &data);
+
+        if (nbytes == 0 || nbytes > p->nbytes || hdr->rings != rings || hdr->data != data)
+                goto fail;
+
+        return 0;
+
+fail:
+        munmap(p->hdr, p->nbytes);
+        return -1;
+}
+
+void *shm_block_ptr(struct shm_block_pool *p, uint32_t index)
+{
+        return p->data + (size_t)index * p->hdr->block_size;
+}
+
+uint32_t shm_block_index(struct shm_block_pool *p, const void *ptr)
+{
+        return (uint32_t)(((const char *)ptr - p->data) / p->hdr->block_size);
+}
+
+/* shared free stack */
+uint32_t shm_stack_pop(struct shm_block_pool *p)
+{
+        uint64_t top = __atomic_load_n(&p->hdr->top, __ATOMIC_ACQUIRE);
+
+        for (;;) {
+                const uint32_t index = shm_top_index(top);
+
+                if (index == SHM_NIL)
+                        return SHM_NIL;
+
+                /* may be stale if another process popped it, then the tag differs */
+                const uint32_t next = __atomic_load_n(&p->next[index], __ATOMIC_RELAXED);
+                const uint64_t new_top = shm_make_top(shm_tag(top) + 1, next);
+
+                if (__atomic_compare_exchange_n(&p->hdr->top, &top, new_top, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                        return index;
+        }
+}
+
+void shm_stack_push(struct shm_block_pool *p, uint32_t index)
+{
+        uint64_t top = __atomic_load_n(&p->hdr->top, __ATOMIC_RELAXED);
+        uint64_t new_top;
+
+        do {
+                __atomic_store_n(&p->next[index], shm_top_index(top), __ATOMIC_RELAXED);
+                new_top = shm_make_top(shm_tag(top) + 1, index);
+        } while (!__atomic_compare_exchange_n(&p->hdr->top, &top, new_top, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+struct shm_ring *shm_ring(struct shm_block_pool *p, int ret, unsigned from, unsigned to)
+{
+        const unsigned n = p->hdr->nprocs;
+
+        return &p->rings[(ret * n * n) + (from * n) + to];
+}
+
+int shm_ring_push(struct shm_ring *r, uint32_t index)
+{
+        const uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+
+        if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == SHM_RING_SIZE)
+                return -1;
+
+        r->slots[tail % SHM_RING_SIZE] = index;
+        __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+
+        return 0;
+}
+
+uint32_t shm_ring_pop(struct shm_ring *r)
+{
+        const uint32_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+
+        if (head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+                return SHM_NIL;
+
+        const uint32_t index = r->slots[head % SHM_RING_SIZE];
+
+        __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+        return index;
+}
+
+/* allocate a block for process me: blocks given back to me first, then the shared stack.
+ * returns the index of the block, SHM_NIL if the pool is empty */
+uint32_t shm_block_alloc(struct shm_block_pool *p, unsigned me)
+{
+        for (unsigned i = 0; i < p->hdr->nprocs; i++) {
+                const uint32_t index = shm_ring_pop(shm_ring(p, 1, i, me));
+
+                if (index != SHM_NIL)
+                        return index;
+        }
+
+        return shm_stack_pop(p);
+}
+
+/* free a block to the shared stack, from any process */
+void shm_block_free(struct shm_block_pool *p, uint32_t index)
+{
+        shm_stack_push(p, index);
+}
+
+/* pass block index from process from to process to. -1 if the ring is full */
+int shm_block_send(struct shm_block_pool *p, unsigned from, unsigned to, uint32_t index)
+{
+        return shm_ring_push(shm_ring(p, 0, from, to), index);
+}
+
+/* next block sent by process from to process me, SHM_NIL if none */
+uint32_t shm_block_recv(struct shm_block_pool *p, unsigned me, unsigned from)
+{
+        return shm_ring_pop(shm_ring(p, 0, from, me));
+}
+
+/* give a block received from process from back to it, or to the shared stack if its
+ * return ring is full */
+void shm_block_release(struct shm_block_pool *p, unsigned me, unsigned from, uint32_t index)
+{
+        if (shm_ring_push(shm_ring(p, 1, me, from), index) != 0)
+                shm_stack_push(p, index);
+}
+
+void shm_block_detach(struct shm_block_pool *p)
+{
+        if (p == NULL || p->hdr == NULL)
+                return;
+
+        munmap(p->hdr, p->nbytes);
+        close(p->fd);
+        p->hdr = NULL;
+}
+
+#endif
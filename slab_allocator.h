@@ -0,0 +1,658 @@
+/* slab_allocator.h -- Implementation of the slab allocation strategy
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <sys/mman.h>
+
+#include "heap.h"
+#include "bit.h"
+#include "block_allocator.h"
+#include "hugepage_filler.h"
+
+enum slab_limits {
+        SLAB_MIN_SHIFT = 4,
+        SLAB_MAX_SHIFT = 12,
+        SLAB_NCLASSES = SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1
+};
+
+/* Design of the system:
+ *      A slab class serves blocks of a single size. It owns a list of slabs, each slab
+ *      being a block_heap of BLOCK_HEAP_MAX blocks. A new slab is allocated from the heap
+ *      when every slab of the class is full; the slab with free blocks found last is moved
+ *      to the front of the list so that the next allocations are served in O(1).
+ *      A slab heap groups power-of-2 size classes from 2^SLAB_MIN_SHIFT to
+ *      2^SLAB_MAX_SHIFT bytes. Requests above the largest class are refused (NULL) and
+ *      must be served by another allocator.
+ *
+ *      classes[0]  (16 B)    slab -> slab -> NULL
+ *      classes[1]  (32 B)    slab -> NULL
+ *      ...
+ *      classes[8]  (4096 B)  NULL
+ *
+ *      The memory of a slab heap can be capped (slab_heap_limit()). Once the cap is
+ *      reached a class without free blocks fails to grow, and the automover
+ *      (slab_automove()) is used to move slabs from classes which no longer need them
+ *      to the classes which run short. The destination is the class with the highest
+ *      rate of allocation failures and evictions (reported by slab_note_eviction()). The
+ *      source is the class with the most free bytes among those whose slabs add up to
+ *      the bytes a slab of the destination needs; nothing is evicted when no class does.
+ *      The slabs of the source with the fewest live blocks are drained (their live blocks
+ *      are handed to an eviction callback) and released until the slab of the
+ *      destination fits.
+ *
+ *      Slab memory comes from the heap, or from a huge page filler when one is set with
+ *      slab_heap_set_filler(), so that the slabs of small objects pack into few huge pages.
+ *
+ *      A class made aligned (slab_class_set_aligned()) allocates each slab as one span,
+ *      the power of 2 above the descriptor and the blocks, aligned on its size; the slab
+ *      of a block is its address rounded down, found in O(1):
+ *
+ *      span:   | struct slab | block 0 | block 1 | ... | block 254 | unused |
+ *              ^ ptr & ~(span - 1)
+ *
+ *      The unused end costs up to half of the span: nothing for power-of-2 blocks of
+ *      32 B and more, 6 KiB of a 16 KiB span (37%) for 40 B blocks. The slab never
+ *      writes the pages of the end, which stay unbacked when the span is mapped.
+ *
+ *      The classes of a slab heap whose descriptor fits in the room of one block (the
+ *      span is then exactly 256 blocks, nothing is lost) are aligned unless a filler is
+ *      set, and a block freed with its size (slab_free_sized()) is released in O(1).
+ *      Other classes walk their slabs to find the slab of a block, and slab_free(), which
+ *      does not know the class of the block, walks the slabs of every class.
+ *
+ *      Allocations hinted ALLOC_HOT or ALLOC_COLD (slab_alloc_flags()) are served by two
+ *      other sets of classes, hot[] and cold[], whose slabs hold nothing else: the hot
+ *      working set is packed in its own pages, and the pages of the cold slabs can be
+ *      given to the kernel for early reclaim (slab_heap_cold()). The automover only moves
+ *      slabs between the unhinted classes.
+ */
+
+struct slab {
+        struct slab             *next;
+        struct block_heap       blk;
+};
+
+struct slab_class {
+        struct heap             *h;
+        struct slab_heap        *owner;
+        struct hp_filler        *pages;
+        size_t                  block_size;
+        size_t                  alignment;
+        struct slab             *slabs;
+        unsigned                nslabs;
+        size_t                  span;
+        unsigned long           allocs;
+        unsigned long           failures;
+        unsigned long           evictions;
+};
+
+struct slab_heap {
+        struct heap             *h;
+        size_t                  limit;
+        size_t                  nbytes;
+        struct slab_class       classes[SLAB_NCLASSES];
+        struct slab_class       hot[SLAB_NCLASSES];
+        struct slab_class       cold[SLAB_NCLASSES];
+};
+
+typedef void (*slab_evict_fn)(void *ctx, void *ptr);
+
+int slab_class_init(struct slab_class *c, struct heap *h, size_t block_size, size_t alignment)
+{
+        if (block_size == 0 || alignment == 0 || (alignment & (alignment - 1)) != 0)
+                return -1;
+
+        c->h = h;
+        c->alignment = alignment;
+        c->block_size = (block_size + alignment - 1) & ~(alignment - 1);
+        c->owner = NULL;
+        c->pages = NULL;
+        c->slabs = NULL;
+        c->nslabs = 0;
+        c->span = 0;
+        c->allocs = 0;
+        c->failures = 0;
+        c->evictions = 0;
+
+        return 0;
+}
+
+size_t slab_bytes(struct slab_class *c)
+{
+        return c->block_size * BLOCK_HEAP_MAX;
+}
+
+/* offset of the blocks in the region of a slab of an aligned class */
+size_t slab_span_offset(struct slab_class *c)
+{
+        return (sizeof(struct slab) + c->alignment - 1) & ~(c->alignment - 1);
+}
+
+/* allocate each slab of c as one span aligned on its size, so that slab_class_owner()
+ * is O(1). the span is the power of 2 above the descriptor and the blocks, see above for
+ * the cost. must be called before the first allocation. not with a filler */
+void slab_class_set_aligned(struct slab_class *c)
+{
+        c->span = (size_t)pow2_roundup64(slab_span_offset(c) + slab_bytes(c));
+}
+
+struct slab *slab_class_grow(struct slab_class *c)
+{
+        struct slab_heap *owner = c->owner;
+
+        if (owner != NULL && owner->limit != 0 && owner->nbytes + slab_bytes(c) > owner->limit)
+                return NULL;
+
+        struct slab *s = (c->span != 0) ? heap_memalign(c->h, c->span, c->span) : heap_alloc(c->h, sizeof(struct slab));
+
+        if (s == NULL)
+                return NULL;
+
+        if (c->span != 0) {
+                block_heap_init_mem(&s->blk, (char *)s + slab_span_offset(c), c->block_size);
+        } else if (c->pages != NULL) {
+                void *mem = hp_filler_alloc(c->pages, hp_filler_npages(slab_bytes(c)));
+
+                if (mem == NULL) {
+                        heap_free(c->h, s);
+                        return NULL;
+                }
+
+                block_heap_init_mem(&s->blk, mem, c->block_size);
+        } else if (block_heap_init(&s->blk, c->h, c->block_size, c->alignment) != 0) {
+                heap_free(c->h, s);
+                return NULL;
+        }
+
+        s->next = c->slabs;
+        c->slabs = s;
+        c->nslabs++;
+
+        if (owner != NULL)
+                owner->nbytes += slab_bytes(c);
+
+        return s;
+}
+
+/* s must be unlinked from the class */
+void slab_class_release(struct slab_class *c, struct slab *s)
+{
+        if (c->pages != NULL)
+                hp_filler_free(c->pages, s->blk.data, hp_filler_npages(slab_bytes(c)));
+        else if (c->span == 0)
+                block_heap_term(&s->blk, c->h);
+
+        heap_free(c->h, s);
+        c->nslabs--;
+
+        if (c->owner != NULL)
+                c->owner->nbytes -= slab_bytes(c);
+}
+
+void *slab_class_alloc(struct slab_class *c)
+{
+        struct slab *prev = NULL;
+        struct slab *s = c->slabs;
+
+        while (s != NULL && s->blk.nblocks == 0) {
+                prev = s;
+                s = s->next;
+        }
+
+        c->allocs++;
+
+        if (s == NULL) {
+                s = slab_class_grow(c);
+
+                if (s == NULL) {
+                        c->failures++;
+                        return NULL;
+                }
+        } else if (prev != NULL) {
+                /* move the slab with free blocks to the front */
+                prev->next = s->next;
+                s->next = c->slabs;
+                c->slabs = s;
+        }
+
+        return block_alloc(&s->blk);
+}
+
+/* the slab of c holding ptr, by a walk of the slabs of c. NULL if c does not own ptr */
+struct slab *slab_class_find(struct slab_class *c, void *ptr)
+{
+        for (struct slab *s = c->slabs; s != NULL; s = s->next) {
+                if (block_is_valid(ptr, s->blk.data, s->blk.nblocks, s->blk.block_size))
+                        return s;
+        }
+
+        return NULL;
+}
+
+/* the slab of c holding ptr, which must be a block of c */
+struct slab *slab_class_owner(struct slab_class *c, void *ptr)
+{
+        /* the slab of an aligned class is trusted, and checked by a walk in debug */
+        if (c->span != 0 && !(c->h->hft & HEAP_DEBUG))
+                return (struct slab *)((uintptr_t)ptr & ~(uintptr_t)(c->span - 1));
+
+        return slab_class_find(c, ptr);
+}
+
+/* allocate from the slab with free blocks closest to hint, at the block closest to hint */
+void *slab_class_alloc_near(struct slab_class *c, const void *hint)
+{
+        struct slab *best = NULL;
+        unsigned best_rank = UINT_MAX;
+        size_t best_dist = SIZE_MAX;
+
+        for (struct slab *s = c->slabs; s != NULL; s = s->next) {
+                if (s->blk.nblocks == 0)
+                        continue;
+
+                /* clamp hint to the range of the slab */
+                const uintptr_t lo = (uintptr_t)s->blk.data;
+                const uintptr_t hi = lo + (BLOCK_HEAP_MAX - 1) * s->blk.block_size;
+                uintptr_t p = (uintptr_t)hint;
+
+                p = (p < lo) ? lo : (p > hi) ? hi : p;
+
+                const unsigned rank = heap_locality((void *)p, hint);
+                const size_t dist = heap_distance((void *)p, hint);
+
+                if (rank < best_rank || (rank == best_rank && dist < best_dist)) {
+                        best = s;
+                        best_rank = rank;
+                        best_dist = dist;
+                }
+        }
+
+        if (best == NULL)
+                return slab_class_alloc(c);
+
+        return block_alloc_near(&best->blk, hint);
+}
+
+int slab_class_free(struct slab_class *c, void *ptr)
+{
+        struct slab *s = slab_class_owner(c, ptr);
+
+        if (s == NULL)
+                return 0;
+
+        block_free(&s->blk, ptr);
+
+        return 1;
+}
+
+/* return the slabs without allocated blocks to the heap */
+void slab_class_trim(struct slab_class *c)
+{
+        struct slab **link = &c->slabs;
+
+        while (*link != NULL) {
+                struct slab *s = *link;
+
+                if (s->blk.nblocks == BLOCK_HEAP_MAX) {
+                        *link = s->next;
+                        slab_class_release(c, s);
+                } else {
+                        link = &s->next;
+                }
+        }
+}
+
+void slab_class_term(struct slab_class *c)
+{
+        if (c == NULL)
+                return;
+
+        while (c->slabs != NULL) {
+                struct slab *s = c->slabs;
+
+                c->slabs = s->next;
+                slab_class_release(c, s);
+        }
+}
+
+int slab_size_class(const size_t nbytes)
+{
+        if (nbytes > bit(SLAB_MAX_SHIFT))
+                return -1;
+
+        if (nbytes <= bit(SLAB_MIN_SHIFT))
+                return 0;
+
+        return trailing_zeros_count(pow2_roundup(nbytes)) - SLAB_MIN_SHIFT;
+}
+
+int slab_heap_init(struct slab_heap *s, struct heap *h, size_t alignment)
+{
+        s->h = h;
+        s->limit = 0;
+        s->nbytes = 0;
+
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                if (slab_class_init(&s->classes[i], h, bit(SLAB_MIN_SHIFT + i), alignment) != 0) {
+                        if (h->hft & HEAP_DEBUG)
+                                printf("slab_heap info: alignment not a power of 2\n");
+                        return -1;
+                }
+
+                s->classes[i].owner = s;
+                if (slab_span_offset(&s->classes[i]) <= s->classes[i].block_size)
+                        slab_class_set_aligned(&s->classes[i]);
+                s->hot[i] = s->classes[i];
+                s->cold[i] = s->classes[i];
+        }
+
+        return 0;
+}
+
+/* take the memory of new slabs from filler f. must be set before the first allocation.
+ * the classes are no longer aligned: slab_free_sized() walks the slabs of the class */
+void slab_heap_set_filler(struct slab_heap *s, struct hp_filler *f)
+{
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                s->classes[i].pages = f;
+                s->classes[i].span = 0;
+                s->hot[i].pages = f;
+                s->hot[i].span = 0;
+                s->cold[i].pages = f;
+                s->cold[i].span = 0;
+        }
+}
+
+/* cap the memory held by the slabs of the heap. 0 removes the cap */
+void slab_heap_limit(struct slab_heap *s, size_t nbytes)
+{
+        s->limit = nbytes;
+}
+
+/* report that an object of size nbytes was evicted by the user to make room */
+void slab_note_eviction(struct slab_heap *s, size_t nbytes)
+{
+        const int index = slab_size_class(nbytes);
+
+        if (index != -1)
+                s->classes[index].evictions++;
+}
+
+unsigned slab_class_free_blocks(struct slab_class *c)
+{
+        unsigned n = 0;
+
+        for (struct slab *s = c->slabs; s != NULL; s = s->next)
+                n += s->blk.nblocks;
+
+        return n;
+}
+
+/* hand every allocated block of slab s to evict */
+void slab_drain(struct slab *s, slab_evict_fn evict, void *ctx)
+{
+        uint32_t free_bits[(BLOCK_HEAP_MAX + 31) / 32] = { 0 };
+        int index = s->blk.first_free_block;
+
+        for (int n = 0; n < s->blk.nblocks; n++) {
+                bit_set(free_bits, index);
+                index = *(uint8_t *)((uintptr_t)s->blk.data + (s->blk.block_size * index));
+        }
+
+        for (int i = 0; i < BLOCK_HEAP_MAX; i++) {
+                if (!bit_check(free_bits, i) && evict != NULL)
+                        evict(ctx, (void *)((uintptr_t)s->blk.data + (s->blk.block_size * i)));
+        }
+}
+
+/* move one slab from the least useful class to the class under the most pressure.
+ * the blocks still allocated in the moved slabs are passed to evict, after which they
+ * must not be used nor freed. returns 1 if a slab was moved, 0 otherwise. nothing is
+ * evicted when 0 is returned, except if the heap fails to allocate the slab of the
+ * destination once the source is drained: the drained bytes are then left free under
+ * the limit. a destination which fits under the limit is not grown (0 is returned), its
+ * next allocation grows it. the pressure counters of every class are halved at each
+ * call. */
+int slab_automove(struct slab_heap *s, slab_evict_fn evict, void *ctx)
+{
+        int dst = -1, src = -1;
+        unsigned long pressure = 0;
+        size_t most_free = 0;
+
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                const unsigned long p = s->classes[i].failures + s->classes[i].evictions;
+
+                if (p > pressure) {
+                        pressure = p;
+                        dst = i;
+                }
+        }
+
+        /* bytes to release before a slab of the destination fits under the limit */
+        size_t needed = 0;
+
+        if (dst != -1 && s->limit != 0 && s->nbytes + slab_bytes(&s->classes[dst]) > s->limit)
+                needed = s->nbytes + slab_bytes(&s->classes[dst]) - s->limit;
+
+        /* slabs of different classes differ in size (4080 B for 16 B blocks, about 1 MiB
+         * for 4096 B blocks): the source must hold enough bytes to cover the destination.
+         * among those, the class with the most free bytes, which evicts the least */
+        for (int i = 0; i < SLAB_NCLASSES && dst != -1 && needed != 0; i++) {
+                struct slab_class *c = &s->classes[i];
+
+                if (i == dst || (size_t)c->nslabs * slab_bytes(c) < needed)
+                        continue;
+
+                const size_t nfree = (size_t)slab_class_free_blocks(c) * c->block_size;
+
+                if (src == -1 || nfree > most_free ||
+                    (nfree == most_free && c->allocs < s->classes[src].allocs)) {
+                        src = i;
+                        most_free = nfree;
+                }
+        }
+
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                s->classes[i].allocs /= 2;
+                s->classes[i].failures /= 2;
+                s->classes[i].evictions /= 2;
+        }
+
+        if (dst == -1 || needed == 0 || src == -1)
+                return 0;
+
+        struct slab_class *d = &s->classes[dst];
+        struct slab_class *c = &s->classes[src];
+
+        /* drain the emptiest slabs first, until one slab of the destination fits */
+        while (c->slabs != NULL && s->nbytes + slab_bytes(d) > s->limit) {
+                struct slab **link = &c->slabs, **victim = &c->slabs;
+
+                for (; *link != NULL; link = &(*link)->next) {
+                        if ((*link)->blk.nblocks > (*victim)->blk.nblocks)
+                                victim = link;
+                }
+
+                struct slab *v = *victim;
+
+                *victim = v->next;
+                slab_drain(v, evict, ctx);
+                slab_class_release(c, v);
+        }
+
+        if (slab_class_grow(d) == NULL) {
+                if (s->h->hft & HEAP_DEBUG)
+                        printf("slab_heap info: class %i drained but class %i failed to grow\n", src, dst);
+                return 0;
+        }
+
+        if (s->h->hft & HEAP_DEBUG)
+                printf("slab_heap info: slab moved from class %i to class %i\n", src, dst);
+
+        return 1;
+}
+
+void *slab_alloc(struct slab_heap *s, size_t nbytes)
+{
+        if (nbytes == 0)
+                return NULL;
+
+        const int index = slab_size_class(nbytes);
+
+        if (index == -1)
+                return NULL;
+
+        return slab_class_alloc(&s->classes[index]);
+}
+
+void *slab_alloc_near(struct slab_heap *s, size_t nbytes, const void *hint)
+{
+        if (nbytes == 0)
+                return NULL;
+
+        const int index = slab_size_class(nbytes);
+
+        if (index == -1)
+                return NULL;
+
+        return slab_class_alloc_near(&s->classes[index], hint);
+}
+
+/* the classes serving the temperature hint of flags */
+struct slab_class *slab_heap_classes(struct slab_heap *s, const unsigned flags)
+{
+        if (flags & ALLOC_HOT)
+                return s->hot;
+        if (flags & ALLOC_COLD)
+                return s->cold;
+
+        return s->classes;
+}
+
+/* slab_alloc() with per allocation flags (see enum alloc_flag) */
+void *slab_alloc_flags(struct slab_heap *s, size_t nbytes, const unsigned flags)
+{
+        if (nbytes == 0)
+                return NULL;
+
+        const int index = slab_size_class(nbytes + alloc_vtail_size(flags));
+
+        if (index == -1)
+                return NULL;
+
+        return alloc_vtail_clear(slab_class_alloc(&slab_heap_classes(s, flags)[index]), nbytes, flags);
+}
+
+/* free a block of unknown size: walks the slabs of every class, O(number of slabs).
+ * prefer slab_free_sized() when the size is known */
+void slab_free(struct slab_heap *s, void *ptr)
+{
+        if (ptr == NULL)
+                return;
+
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                struct slab_class *cls[] = { &s->classes[i], &s->hot[i], &s->cold[i] };
+
+                for (int k = 0; k < 3; k++) {
+                        struct slab *sl = slab_class_find(cls[k], ptr);
+
+                        if (sl != NULL) {
+                                block_free(&sl->blk, ptr);
+                                return;
+                        }
+                }
+        }
+
+        if (s->h->hft & HEAP_DEBUG)
+                printf("slab_heap info: @%p not owned by slab heap\n", ptr);
+}
+
+/* free a block allocated by slab_alloc_flags(s, nbytes, flags), or by slab_alloc(s,
+ * nbytes) with flags 0. O(1) unless a filler is set */
+void slab_free_sized(struct slab_heap *s, void *ptr, size_t nbytes, const unsigned flags)
+{
+        if (ptr == NULL)
+                return;
+
+        const int index = slab_size_class(nbytes + alloc_vtail_size(flags));
+
+        if (index == -1 || !slab_class_free(&slab_heap_classes(s, flags)[index], ptr)) {
+                if (s->h->hft & HEAP_DEBUG)
+                        printf("slab_heap info: @%p not owned by slab heap\n", ptr);
+        }
+}
+
+void slab_heap_trim(struct slab_heap *s)
+{
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                slab_class_trim(&s->classes[i]);
+                slab_class_trim(&s->hot[i]);
+                slab_class_trim(&s->cold[i]);
+        }
+}
+
+/* tell the kernel that the whole pages of [ptr, ptr + nbytes) are rarely used: they are
+ * reclaimed first under memory pressure, without losing their content */
+int slab_advise_cold(void *ptr, size_t nbytes)
+{
+#ifdef MADV_COLD
+        const uintptr_t start = ((uintptr_t)ptr + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+        const uintptr_t end = ((uintptr_t)ptr + nbytes) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1);
+
+        if (end <= start)
+                return 0;
+
+        return madvise((void *)start, end - start, MADV_COLD);
+#else
+        return 0;
+#endif
+}
+
+/* release the empty cold slabs, and advise the kernel that the others are rarely used */
+void slab_heap_cold(struct slab_heap *s)
+{
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                struct slab_class *c = &s->cold[i];
+
+                slab_class_trim(c);
+
+                for (struct slab *sl = c->slabs; sl != NULL; sl = sl->next)
+                        slab_advise_cold(sl->blk.data, slab_bytes(c));
+        }
+}
+
+void slab_heap_term(struct slab_heap *s)
+{
+        if (s == NULL)
+                return;
+
+        for (int i = 0; i < SLAB_NCLASSES; i++) {
+                slab_class_term(&s->classes[i]);
+                slab_class_term(&s->hot[i]);
+                slab_class_term(&s->cold[i]);
+        }
+}
+
+#endif
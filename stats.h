@@ -0,0 +1,487 @@
+/* stats.h -- Statistics snapshots of the registered allocators in JSON and Prometheus text
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ctl.h"
+
+enum stats_format : unsigned {
+        STATS_JSON,
+        STATS_PROMETHEUS
+};
+
+enum stats_limits {
+        STATS_MAX_LEAVES = 8,
+        STATS_MAX_GROUPS = 32,
+        STATS_MAX_PATH = 256
+};
+
+/* Design of the system:
+ *      A snapshot walks the ctl registry (see ctl.h) and reads, through the ctl keys,
+ *      every statistic of every registered instance into a capture, before formatting
+ *      any of them: the lines of a snapshot, whatever their order in the format, show
+ *      the values of one read. stats_write_fd() formats the capture into a private
+ *      buffer before writing it. The counters are read one after the other with relaxed
+ *      atomic loads (see ctl.h): a snapshot taken while other threads allocate is not a
+ *      consistent cut across threads, each value is only untorn.
+ *
+ *      JSON:           { "buddy": [ { "index": 0, "k": 16, "free_bytes": 65280,
+ *                                     "order": { "6": { "free": 0 }, ... } } ], ... }
+ *      Prometheus:     alloc_buddy_free_bytes{instance="0"} 65280
+ *                      alloc_buddy_order_free{instance="0",order="12"} 3
+ *
+ *      A dump to a file can be requested by a signal, or by creating a trigger file; the
+ *      signal handler only raises a flag, the program calls stats_dump_poll() from its
+ *      main loop to write the dump. The file is written under a temporary name and
+ *      renamed, so a scraper never reads a partial file.
+ */
+
+/* the statistics of a kind: plain keys, then keys of a group indexed by a number */
+struct stats_desc {
+        const char      *leaves[STATS_MAX_LEAVES];
+        const char      *group;
+        const char      *group_leaves[STATS_MAX_LEAVES];
+};
+
+const struct stats_desc stats_descs[CTL_NKINDS] = {
+        [CTL_HEAP] = { { "alloc_count" } },
+        [CTL_BUDDY] = { { "k", "free_bytes" }, "order", { "free" } },
+        [CTL_BLOCK] = { { "block_size", "nblocks", "free_blocks" } },
+        [CTL_SCRATCH] = { { "chunks", "used", "capacity" } },
+        [CTL_SLAB] = {
+                { "limit", "nbytes" }, "class",
+                { "block_size", "nslabs", "allocs", "failures", "evictions", "free_blocks" }
+        },
+        [CTL_EXTENT] = { { "npages", "free_pages" } },
+        [CTL_LARGE] = { { "decay_ms", "max_retained", "retained", "mapped" } },
+        [CTL_HP_FILLER] = { { "nhugepages", "used_pages" } },
+        [CTL_TCACHE] = {
+                { "cap", "cached", "ncaches", "rebalances" }, "class",
+                { "block_size", "cached_blocks", "max_blocks", "refills", "flushes" }
+        }
+};
+
+/* the values of one instance, read before any formatting */
+struct stats_values {
+        struct ctl_entry        e;
+        uint64_t                leaves[STATS_MAX_LEAVES];
+        unsigned                lo, hi;
+        unsigned                ngroups;
+        uint64_t                groups[STATS_MAX_GROUPS][STATS_MAX_LEAVES];
+};
+
+struct stats_capture {
+        unsigned                nentries;
+        struct stats_values     entries[CTL_MAX_INSTANCES];
+};
+
+struct stats_out {
+        char    *buf;
+        size_t  size;
+        size_t  len;
+};
+
+struct stats_dump {
+        char                    path[STATS_MAX_PATH];
+        char                    trigger[STATS_MAX_PATH];
+        enum stats_format       fmt;
+        volatile sig_atomic_t   pending;
+};
+
+struct stats_dump stats_dump_cfg;
+
+/* like snprintf, len counts what would have been written past the end of the buffer */
+void stats_printf(struct stats_out *o, const char *fmt, ...)
+{
+        va_list ap;
+        const size_t room = (o->len < o->size) ? o->size - o->len : 0;
+
+        va_start(ap, fmt);
+        const int n = vsnprintf(room ? o->buf + o->len : NULL, room, fmt, ap);
+        va_end(ap);
+
+        if (n > 0)
+                o->len += n;
+}
+
+/* range of the group indexes of instance e */
+int stats_group_range(const struct ctl_entry *e, unsigned *lo, unsigned *hi)
+{
+        switch (e->kind) {
+        case CTL_BUDDY:
+                *lo = BUDDY_MIN_K;
+                *hi = ((struct buddy_heap *)e->obj)->k;
+                return 0;
+        case CTL_SLAB:
+                *lo = 0;
+                *hi = SLAB_NCLASSES - 1;
+                return 0;
+        case CTL_TCACHE:
+                *lo = 0;
+                *hi = TCACHE_NCLASSES - 1;
+                return 0;
+        default:
+                return -1;
+        }
+}
+
+/* value of leaf, or of group.sub.leaf when group is not NULL */
+uint64_t stats_value(const struct ctl_entry *e, const char *group, unsigned sub, const char *leaf)
+{
+        char num[16];
+        char *tok[3];
+        uint64_t v = 0;
+        int n = 0;
+
+        if (group != NULL) {
+                snprintf(num, sizeof(num), "%u", sub);
+                tok[n++] = (char *)group;
+                tok[n++] = num;
+        }
+        tok[n++] = (char *)leaf;
+
+        ctl_fns[e->kind](e->obj, tok, n, &v, NULL);
+
+        return v;
+}
+
+/* read every value of instance e */
+void stats_read(struct stats_values *v, const struct ctl_entry *e)
+{
+        const struct stats_desc *d = &stats_descs[e->kind];
+
+        v->e = *e;
+        v->ngroups = 0;
+
+        for (int i = 0; i < STATS_MAX_LEAVES && d->leaves[i] != NULL; i++)
+                v->leaves[i] = stats_value(e, NULL, 0, d->leaves[i]);
+
+        if (d->group == NULL || stats_group_range(e, &v->lo, &v->hi) != 0)
+                return;
+
+        for (unsigned s = v->lo; s <= v->hi && v->ngroups < STATS_MAX_GROUPS; s++, v->ngroups++) {
+                for (int i = 0; i < STATS_MAX_LEAVES && d->group_leaves[i] != NULL; i++)
+                        v->groups[v->ngroups][i] = stats_value(e, d->group, s, d->group_leaves[i]);
+        }
+}
+
+/* read the values of every registered instance */
+void stats_capture(struct stats_capture *c)
+{
+        c->nentries = 0;
+
+        for (unsigned i = 0; i < ctl_reg.nentries; i++) {
+                if (ctl_reg.entries[i].obj != NULL)
+                        stats_read(&c->entries[c->nentries++], &ctl_reg.entries[i]);
+        }
+}
+
+int stats_is_counter(const char *leaf)
+{
+        return strcmp(leaf, "allocs") == 0 || strcmp(leaf, "failures") == 0 ||
+               strcmp(leaf, "evictions") == 0 || strcmp(leaf, "refills") == 0 ||
+               strcmp(leaf, "flushes") == 0 || strcmp(leaf, "rebalances") == 0;
+}
+
+void stats_json_entry(struct stats_out *o, const struct stats_values *v)
+{
+        const struct stats_desc *d = &stats_descs[v->e.kind];
+
+        stats_printf(o, "{\"index\":%u", v->e.index);
+
+        for (int i = 0; i < STATS_MAX_LEAVES && d->leaves[i] != NULL; i++)
+                stats_printf(o, ",\"%s\":%llu", d->leaves[i], (unsigned long long)v->leaves[i]);
+
+        if (v->ngroups != 0) {
+                stats_printf(o, ",\"%s\":{", d->group);
+
+                for (unsigned g = 0; g < v->ngroups; g++) {
+                        stats_printf(o, "%s\"%u\":{", g ? "," : "", v->lo + g);
+
+                        for (int i = 0; i < STATS_MAX_LEAVES && d->group_leaves[i] != NULL; i++)
+                                stats_printf(o, "%s\"%s\":%llu", i ? "," : "", d->group_leaves[i],
+                                             (unsigned long long)v->groups[g][i]);
+
+                        stats_printf(o, "}");
+                }
+
+                stats_printf(o, "}");
+        }
+
+        stats_printf(o, "}");
+}
+
+void stats_json(struct stats_out *o, const struct stats_capture *c)
+{
+        stats_printf(o, "{");
+
+        for (int k = 0; k < CTL_NKINDS; k++) {
+                int first = 1;
+
+                stats_printf(o, "%s\"%s\":[", k ? "," : "", ctl_kind_names[k]);
+
+                for (unsigned i = 0; i < c->nentries; i++) {
+                        if (c->entries[i].e.kind != (enum ctl_kind)k)
+                                continue;
+
+                        stats_printf(o, first ? "" : ",");
+                        stats_json_entry(o, &c->entries[i]);
+                        first = 0;
+                }
+
+                stats_printf(o, "]");
+        }
+
+        stats_printf(o, "}\n");
+}
+
+/* 1 if an instance of kind was captured */
+int stats_kind_live(const struct stats_capture *c, int kind)
+{
+        for (unsigned i = 0; i < c->nentries; i++) {
+                if (c->entries[i].e.kind == (enum ctl_kind)kind)
+                        return 1;
+        }
+
+        return 0;
+}
+
+/* the lines of a metric family must be contiguous: each metric is walked over all the
+ * instances of the kind. leaf is the index of a plain key, or of a group key if group */
+void stats_prometheus_metric(struct stats_out *o, const struct stats_capture *c, int kind, int group, int leaf)
+{
+        const struct stats_desc *d = &stats_descs[kind];
+        const char *key = group ? d->group_leaves[leaf] : d->leaves[leaf];
+        const char *suffix = stats_is_counter(key) ? "_total" : "";
+        char name[CTL_MAX_KEY];
+
+        snprintf(name, sizeof(name), "alloc_%s_%s%s%s%s", ctl_kind_names[kind],
+                 group ? d->group : "", group ? "_" : "", key, suffix);
+
+        stats_printf(o, "# TYPE %s %s\n", name, *suffix ? "counter" : "gauge");
+
+        for (unsigned i = 0; i < c->nentries; i++) {
+                const struct stats_values *v = &c->entries[i];
+
+                if (v->e.kind != (enum ctl_kind)kind)
+                        continue;
+
+                if (!group) {
+                        stats_printf(o, "%s{instance=\"%u\"} %llu\n", name, v->e.index,
+                                     (unsigned long long)v->leaves[leaf]);
+                        continue;
+                }
+
+                for (unsigned g = 0; g < v->ngroups; g++)
+                        stats_printf(o, "%s{instance=\"%u\",%s=\"%u\"} %llu\n", name, v->e.index,
+                                     d->group, v->lo + g, (unsigned long long)v->groups[g][leaf]);
+        }
+}
+
+void stats_prometheus(struct stats_out *o, const struct stats_capture *c)
+{
+        for (int k = 0; k < CTL_NKINDS; k++) {
+                const struct stats_desc *d = &stats_descs[k];
+
+                /* a family without samples would be announced by a bare # TYPE line */
+                if (!stats_kind_live(c, k))
+                        continue;
+
+                for (int i = 0; i < STATS_MAX_LEAVES && d->leaves[i] != NULL; i++)
+                        stats_prometheus_metric(o, c, k, 0, i);
+
+                for (int i = 0; d->group != NULL && i < STATS_MAX_LEAVES && d->group_leaves[i] != NULL; i++)
+                        stats_prometheus_metric(o, c, k, 1, i);
+        }
+}
+
+/* format the values of c into buf. returns the length of the snapshot (like snprintf:
+ * it was truncated if the return value is size or more) */
+size_t stats_format(const struct stats_capture *c, char *buf, size_t size, enum stats_format fmt)
+{
+        struct stats_out o = { buf, size, 0 };
+
+        if (fmt == STATS_JSON)
+                stats_json(&o, c);
+        else
+                stats_prometheus(&o, c);
+
+        return o.len;
+}
+
+/* write a snapshot to buf. returns the length of the snapshot (like snprintf: it was
+ * truncated if the return value is size or more), 0 if out of memory */
+size_t stats_snapshot(char *buf, size_t size, enum stats_format fmt)
+{
+        struct stats_capture *c = malloc(sizeof(*c));
+
+        if (c == NULL) {
+                if (size != 0)
+                        buf[0] = '\0';
+                return 0;
+        }
+
+        stats_capture(c);
+
+        const size_t len = stats_format(c, buf, size, fmt);
+
+        free(c);
+
+        return len;
+}
+
+int stats_write_fd(int fd, enum stats_format fmt)
+{
+        size_t size = 4096, len;
+        char *buf = NULL;
+        struct stats_capture *c = malloc(sizeof(*c));
+
+        if (c == NULL)
+                return -1;
+
+        stats_capture(c);
+
+        /* the values are read once, formatted until they fit */
+        for (;;) {
+                char *p = realloc(buf, size);
+
+                if (p == NULL) {
+                        free(buf);
+                        free(c);
+                        return -1;
+                }
+
+                buf = p;
+                len = stats_format(c, buf, size, fmt);
+
+                if (len < size)
+                        break;
+
+                size = len + 1;
+        }
+
+        free(c);
+
+        for (size_t off = 0; off < len;) {
+                const ssize_t n = write(fd, buf + off, len - off);
+
+                if (n < 0 && errno == EINTR)
+                        continue;
+
+                if (n < 0) {
+                        free(buf);
+                        return -1;
+                }
+
+                off += n;
+        }
+
+        free(buf);
+
+        return 0;
+}
+
+void stats_dump_handler(int signo)
+{
+        (void)signo;
+        stats_dump_cfg.pending = 1;
+}
+
+/* dump the snapshot to path when signo is received (0: no signal) or when the trigger
+ * file (NULL: none) is created */
+int stats_dump_init(const char *path, const char *trigger, int signo, enum stats_format fmt)
+{
+        if (path == NULL || strlen(path) >= STATS_MAX_PATH)
+                return -1;
+        if (trigger != NULL && strlen(trigger) >= STATS_MAX_PATH)
+                return -1;
+
+        strcpy(stats_dump_cfg.path, path);
+        strcpy(stats_dump_cfg.trigger, (trigger != NULL) ? trigger : "");
+        stats_dump_cfg.fmt = fmt;
+        stats_dump_cfg.pending = 0;
+
+        if (signo != 0) {
+                struct sigaction sa;
+
+                memset(&sa, 0, sizeof(sa));
+                sa.sa_handler = stats_dump_handler;
+                sa.sa_flags = SA_RESTART;
+                sigemptyset(&sa.sa_mask);
+
+                if (sigaction(signo, &sa, NULL) != 0)
+                        return -1;
+        }
+
+        return 0;
+}
+
+int stats_dump(void)
+{
+        char tmp[STATS_MAX_PATH + 8];
+
+        snprintf(tmp, sizeof(tmp), "%s.tmp", stats_dump_cfg.path);
+
+        const int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+        if (fd < 0)
+                return -1;
+
+        if (stats_write_fd(fd, stats_dump_cfg.fmt) != 0) {
+                close(fd);
+                unlink(tmp);
+                return -1;
+        }
+
+        close(fd);
+
+        return rename(tmp, stats_dump_cfg.path);
+}
+
+/* returns 1 if a dump was written, 0 if none was requested, -1 on error */
+int stats_dump_poll(void)
+{
+        int requested = 0;
+
+        if (stats_dump_cfg.pending) {
+                stats_dump_cfg.pending = 0;
+                requested = 1;
+        }
+
+        if (stats_dump_cfg.trigger[0] != '\0' && unlink(stats_dump_cfg.trigger) == 0)
+                requested = 1;
+
+        if (!requested || stats_dump_cfg.path[0] == '\0')
+                return 0;
+
+        return (stats_dump() == 0) ? 1 : -1;
+}
+
+#endif
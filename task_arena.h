@@ -0,0 +1,168 @@
+/* task_arena.h -- Fork-join scratch arenas for the tasks of parallel algorithms
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TASK_ARENA_H
+#define TASK_ARENA_H
+
+#include "heap.h"
+#include "scratch_allocator.h"
+
+/* Design of the system:
+ *      A parallel phase forks tasks from a parent scratch chain (see scratch_allocator.h).
+ *      Each task gets a task arena whose first region is carved from the current chunk
+ *      of the parent with a compare-and-swap on its head: tasks running on different
+ *      threads fork without a lock. When the carved region is full the task grows its own
+ *      chain of chunks, allocated from the heap of the parent.
+ *
+ *      parent chunks:  [current: | task 0 | task 1 | task 2 | free ] -> [older] -> NULL
+ *      task 1 chunks:  [chunk b] -> [chunk a] -> NULL
+ *
+ *      At the join, the results are either kept or copied out:
+ *              task_arena_join()       splices the chunks of the task right after the
+ *                                      current chunk of the parent in O(1) (compare-and-
+ *                                      swap, tasks may join concurrently). The memory of
+ *                                      the task lives until the parent is reset or
+ *                                      terminated.
+ *              task_arena_discard()    releases the chunks of the task, and gives the
+ *                                      carved region back if no other task carved after it.
+ *
+ *      The parent must not allocate, reset or terminate during the parallel phase. The
+ *      heap of the parent is shared by the tasks (see scratch_chain in scratch_allocator.h
+ *      for the heap flags this allows).
+ */
+
+#define TASK_ARENA_CARVE 4096
+
+struct task_arena {
+        struct scratch_chain    *parent;
+        struct scratch_heap     carved;
+        void                    *mark;
+        struct scratch_chain    chain;
+        struct scratch_chunk    *tail;
+};
+
+/* carve nbytes from the current chunk of chn, NULL if it does not have room. *mark is
+ * set to the head of the chunk before the carve, alignment padding included */
+void *task_arena_carve(struct scratch_chain *chn, size_t nbytes, void **mark)
+{
+        struct scratch_heap *scr = &chn->chunks->scr;
+        void *head = __atomic_load_n(&scr->head, __ATOMIC_RELAXED);
+        uintptr_t base, end;
+
+        do {
+                base = ((uintptr_t)head + chn->alignment - 1) & ~(chn->alignment - 1);
+                end = base + nbytes;
+
+                if (end > (uintptr_t)scr->tail)
+                        return NULL;
+        } while (!__atomic_compare_exchange_n(&scr->head, &head, (void *)end, 1,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        *mark = head;
+
+        return (void *)base;
+}
+
+/* fork a task arena from parent, with a first region of nbytes (0: TASK_ARENA_CARVE)
+ * carved from the current chunk of the parent */
+int task_arena_fork(struct task_arena *t, struct scratch_chain *parent, size_t nbytes)
+{
+        if (parent == NULL || parent->chunks == NULL)
+                return -1;
+
+        if (nbytes == 0)
+                nbytes = TASK_ARENA_CARVE;
+
+        nbytes = (nbytes + parent->alignment - 1) & ~(parent->alignment - 1);
+
+        t->parent = parent;
+        t->tail = NULL;
+        t->carved.mem = task_arena_carve(parent, nbytes, &t->mark);
+        t->carved.head = t->carved.mem;
+        t->carved.tail = (t->carved.mem != NULL) ? (void *)((uintptr_t)t->carved.mem + nbytes) : NULL;
+
+        /* the chain of the task starts without chunk, see scratch_chain_alloc() */
+        t->chain.h = parent->h;
+        t->chain.chunk_size = parent->chunk_size;
+        t->chain.alignment = parent->alignment;
+        t->chain.chunks = NULL;
+
+        return 0;
+}
+
+void *task_alloc(struct task_arena *t, size_t nbytes, size_t alignment)
+{
+        void *ptr = NULL;
+
+        if (t->carved.mem != NULL && t->chain.chunks == NULL)
+                ptr = scratch_alloc(&t->carved, nbytes, alignment);
+
+        if (ptr != NULL)
+                return ptr;
+
+        ptr = scratch_chain_alloc(&t->chain, nbytes, alignment);
+
+        /* chunks are pushed at the front: the first one is the tail of the list */
+        if (t->tail == NULL)
+                t->tail = t->chain.chunks;
+
+        return ptr;
+}
+
+/* keep the allocations of the task: its chunks are handed to the parent */
+void task_arena_join(struct task_arena *t)
+{
+        struct scratch_chunk *current = t->parent->chunks;
+        struct scratch_chunk *next = __atomic_load_n(&current->next, __ATOMIC_RELAXED);
+
+        if (t->chain.chunks == NULL)
+                return;
+
+        do {
+                t->tail->next = next;
+        } while (!__atomic_compare_exchange_n(&current->next, &next, t->chain.chunks, 1,
+                                              __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+        t->chain.chunks = NULL;
+        t->tail = NULL;
+}
+
+/* drop the allocations of the task, whose results were copied out */
+void task_arena_discard(struct task_arena *t)
+{
+        struct scratch_heap *scr = &t->parent->chunks->scr;
+        void *end = t->carved.tail;
+
+        scratch_chain_term(&t->chain);
+        t->tail = NULL;
+
+        /* give the carved region and its padding back if it is still the last one of
+         * the chunk */
+        if (t->carved.mem != NULL)
+                __atomic_compare_exchange_n(&scr->head, &end, t->mark, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+
+        t->carved.mem = NULL;
+}
+
+#endif
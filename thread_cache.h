@@ -0,0 +1,498 @@
+/* thread_cache.h -- Adaptive per-thread caches in front of the slab and buddy allocators
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef THREAD_CACHE_H
+#define THREAD_CACHE_H
+
+#include "heap.h"
+#include "bit.h"
+#include "slab_allocator.h"
+#include "buddy_allocator.h"
+
+enum tcache_limits {
+        TCACHE_MAX_SHIFT = 16,
+        TCACHE_NCLASSES = TCACHE_MAX_SHIFT - SLAB_MIN_SHIFT + 1,
+        TCACHE_MIN_BLOCKS = 4,
+        TCACHE_BIN_BYTES = 1 << 18,
+        TCACHE_GROW_MISSES = 2,
+        TCACHE_GC_EVENTS = 1024
+};
+
+/* Design of the system:
+ *      A tcache pool shares a slab heap (classes of 2^4 to 2^12 bytes) and optionally a
+ *      buddy heap (blocks of 2^13 to 2^TCACHE_MAX_SHIFT bytes, less the buddy prefix)
+ *      between threads, behind a spin lock. Each thread allocates through its own thread
+ *      cache, which keeps a bin of free blocks per class and goes to the pool only to
+ *      refill or flush a bin, a batch of blocks at a time:
+ *
+ *      thread cache:   bins[0]  (16 B)   head -> blk -> blk -> NULL     count 2, max 8
+ *                      bins[1]  (32 B)   NULL                           count 0, max 4
+ *                      ...
+ *      tcache pool:    [ lock | slab heap | buddy heap | cached bytes | caches ]
+ *
+ *      The size of each bin (max) adapts to the thread:
+ *              miss            a bin found empty TCACHE_GROW_MISSES times in a window
+ *                              doubles its max (up to TCACHE_BIN_BYTES of blocks); a
+ *                              refill brings max / 2 blocks.
+ *              overflow        a bin above max after a free flushes down to max / 2.
+ *              idle            every TCACHE_GC_EVENTS operations, a bin whose low
+ *                              watermark (the fewest blocks it held in the window) is
+ *                              not 0 flushes 3/4 of the watermark, blocks which were
+ *                              not used, and halves its max (down to TCACHE_MIN_BLOCKS).
+ *
+ *      A bursty thread grows large bins during a burst and gives them back once idle; a
+ *      steady thread keeps bins just above its working set.
+ *      The pool caps the total bytes cached by all the threads (cap, 0: no cap). A free
+ *      finding the total above the cap flushes the bin it freed into, down to max / 2
+ *      then by halves, until the total is under the cap or the bin is empty. If the
+ *      total is still above the cap, the other caches hold it: every cache is requested
+ *      to shrink, and at its next operation flushes its idle blocks and its blocks above
+ *      max / 2 of each bin, and halves the bins. A thread which keeps finding the pool
+ *      above the cap requests it again, and a refill which would take the total above
+ *      the cap brings a single block. Blocks are not moved from one cache to another:
+ *      the cap only makes the caches give their blocks back to the pool. A thread about
+ *      to sleep for long should call thread_cache_flush() itself.
+ *
+ *      Frees are sized: the size given to tcache_free() is the size of the allocation.
+ *      A block may be freed by another thread than the one which allocated it. The slab
+ *      and buddy heaps must not be used directly while the pool is in use, nor the slab
+ *      heap rebalanced with slab_automove(): the blocks cached in the bins look live to
+ *      it and would be handed to its eviction callback. Requests above the largest class
+ *      get NULL and must be served by another allocator.
+ */
+
+struct tcache_bin {
+        void                    *head;
+        unsigned                count;
+        unsigned                max;
+        unsigned                low;
+        unsigned                misses;
+        unsigned long           refills;
+        unsigned long           flushes;
+};
+
+struct thread_cache;
+
+struct tcache_pool {
+        struct slab_heap        *slab;
+        struct buddy_heap       *buddy;
+        size_t                  cap;
+        size_t                  cached;
+        struct thread_cache     *caches;
+        unsigned                ncaches;
+        unsigned long           rebalances;
+        /* counters of the bins of the caches already terminated */
+        unsigned long           refills[TCACHE_NCLASSES];
+        unsigned long           flushes[TCACHE_NCLASSES];
+        char                    lock;
+};
+
+struct thread_cache {
+        struct tcache_pool      *pool;
+        struct thread_cache     *next;
+        struct tcache_bin       bins[TCACHE_NCLASSES];
+        size_t                  cached;
+        unsigned                events;
+        int                     shrink;
+};
+
+void tcache_pool_lock(struct tcache_pool *p)
+{
+        heap_spin_lock(&p->lock);
+}
+
+void tcache_pool_unlock(struct tcache_pool *p)
+{
+        heap_spin_unlock(&p->lock);
+}
+
+/* buddy may be NULL (no class above 2^SLAB_MAX_SHIFT). cap on the cached bytes, 0: none */
+int tcache_pool_init(struct tcache_pool *p, struct slab_heap *slab, struct buddy_heap *buddy, size_t cap)
+{
+        if (slab == NULL)
+                return -1;
+
+        p->slab = slab;
+        p->buddy = buddy;
+        p->cap = cap;
+        p->cached = 0;
+        p->caches = NULL;
+        p->ncaches = 0;
+        p->rebalances = 0;
+        p->lock = 0;
+
+        for (int i = 0; i < TCACHE_NCLASSES; i++) {
+                p->refills[i] = 0;
+                p->flushes[i] = 0;
+        }
+
+        return 0;
+}
+
+size_t tcache_class_size(const int cls)
+{
+        return bit(SLAB_MIN_SHIFT + cls);
+}
+
+/* room of a block of a buddy class, whose prefix is taken from the 2^k bytes */
+size_t tcache_buddy_nbytes(struct tcache_pool *p, const int cls)
+{
+        return tcache_class_size(cls) - (p->buddy->alignment - 1 + sizeof(struct buddy_block_prefix));
+}
+
+int tcache_class(struct tcache_pool *p, const size_t nbytes)
+{
+        if (nbytes == 0 || nbytes > bit(TCACHE_MAX_SHIFT))
+                return -1;
+
+        if (nbytes <= bit(SLAB_MAX_SHIFT))
+                return slab_size_class(nbytes);
+
+        if (p->buddy == NULL)
+                return -1;
+
+        int cls = trailing_zeros_count(pow2_roundup(nbytes)) - SLAB_MIN_SHIFT;
+
+        if (nbytes > tcache_buddy_nbytes(p, cls))
+                cls++;
+
+        return (cls < TCACHE_NCLASSES) ? cls : -1;
+}
+
+/* at most TCACHE_BIN_BYTES of blocks, at least TCACHE_MIN_BLOCKS */
+unsigned tcache_bin_limit(const int cls)
+{
+        const size_t n = TCACHE_BIN_BYTES / tcache_class_size(cls);
+
+        return (n < TCACHE_MIN_BLOCKS) ? TCACHE_MIN_BLOCKS : (unsigned)n;
+}
+
+/* the pool must be locked */
+void *tcache_backend_alloc(struct tcache_pool *p, const int cls)
+{
+        if (cls < SLAB_NCLASSES)
+                return slab_class_alloc(&p->slab->classes[cls]);
+
+        return buddy_alloc(p->buddy, tcache_buddy_nbytes(p, cls));
+}
+
+/* the pool must be locked */
+void tcache_backend_free(struct tcache_pool *p, const int cls, void *ptr)
+{
+        if (cls < SLAB_NCLASSES)
+                slab_class_free(&p->slab->classes[cls], ptr);
+        else
+                buddy_free(p->buddy, ptr);
+}
+
+void tcache_account(struct thread_cache *tc, const int cls, const long nblocks)
+{
+        const size_t nbytes = tcache_class_size(cls) * (size_t)(nblocks < 0 ? -nblocks : nblocks);
+
+        if (nblocks < 0) {
+                tc->cached -= nbytes;
+                __atomic_sub_fetch(&tc->pool->cached, nbytes, __ATOMIC_RELAXED);
+        } else {
+                tc->cached += nbytes;
+                __atomic_add_fetch(&tc->pool->cached, nbytes, __ATOMIC_RELAXED);
+        }
+}
+
+/* give the blocks of bin cls back to the pool until keep are left */
+void tcache_flush(struct thread_cache *tc, const int cls, const unsigned keep)
+{
+        struct tcache_bin *bin = &tc->bins[cls];
+        long n = 0;
+
+        if (bin->count <= keep)
+                return;
+
+        tcache_pool_lock(tc->pool);
+
+        while (bin->count > keep) {
+                void *ptr = bin->head;
+
+                bin->head = *(void **)ptr;
+                bin->count--;
+                tcache_backend_free(tc->pool, cls, ptr);
+                n++;
+        }
+
+        tcache_pool_unlock(tc->pool);
+
+        if (bin->low > bin->count)
+                bin->low = bin->count;
+
+        bin->flushes++;
+        tcache_account(tc, cls, -n);
+}
+
+int thread_cache_init(struct thread_cache *tc, struct tcache_pool *p)
+{
+        tc->pool = p;
+        tc->cached = 0;
+        tc->events = 0;
+        tc->shrink = 0;
+
+        for (int i = 0; i < TCACHE_NCLASSES; i++) {
+                struct tcache_bin *bin = &tc->bins[i];
+
+                bin->head = NULL;
+                bin->count = 0;
+                bin->max = TCACHE_MIN_BLOCKS;
+                bin->low = 0;
+                bin->misses = 0;
+                bin->refills = 0;
+                bin->flushes = 0;
+        }
+
+        tcache_pool_lock(p);
+        tc->next = p->caches;
+        p->caches = tc;
+        p->ncaches++;
+        tcache_pool_unlock(p);
+
+        return 0;
+}
+
+/* end of a window of TCACHE_GC_EVENTS operations: shrink the bins whose blocks sat idle */
+void tcache_gc(struct thread_cache *tc)
+{
+        for (int i = 0; i < TCACHE_NCLASSES; i++) {
+                struct tcache_bin *bin = &tc->bins[i];
+
+                if (bin->low > 0) {
+                        tcache_flush(tc, i, bin->count - (bin->low - bin->low / 4));
+
+                        if (bin->max / 2 >= TCACHE_MIN_BLOCKS)
+                                bin->max /= 2;
+                }
+
+                bin->low = bin->count;
+                bin->misses = 0;
+        }
+
+        tc->events = 0;
+}
+
+/* shrink request of the pool (see tcache_rebalance()): flush the idle blocks, and the
+ * blocks above max / 2, of every bin */
+void tcache_shrink(struct thread_cache *tc)
+{
+        for (int i = 0; i < TCACHE_NCLASSES; i++) {
+                struct tcache_bin *bin = &tc->bins[i];
+                const unsigned used = bin->count - bin->low;
+
+                tcache_flush(tc, i, (used < bin->max / 2) ? used : bin->max / 2);
+
+                if (bin->max / 2 >= TCACHE_MIN_BLOCKS)
+                        bin->max /= 2;
+
+                bin->low = bin->count;
+        }
+}
+
+/* the caches of the other threads hold the bytes above the cap: every cache is
+ * requested to shrink, the caller at once */
+void tcache_rebalance(struct thread_cache *tc)
+{
+        struct tcache_pool *p = tc->pool;
+
+        tcache_pool_lock(p);
+
+        for (struct thread_cache *c = p->caches; c != NULL; c = c->next)
+                __atomic_store_n(&c->shrink, 1, __ATOMIC_RELAXED);
+
+        p->rebalances++;
+        tcache_pool_unlock(p);
+
+        __atomic_store_n(&tc->shrink, 0, __ATOMIC_RELAXED);
+        tcache_shrink(tc);
+}
+
+void tcache_event(struct thread_cache *tc)
+{
+        if (__atomic_load_n(&tc->shrink, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&tc->shrink, 0, __ATOMIC_RELAXED))
+                tcache_shrink(tc);
+
+        if (++tc->events >= TCACHE_GC_EVENTS)
+                tcache_gc(tc);
+}
+
+/* empty bin: grow it if it misses often, and bring max / 2 blocks from the pool */
+void *tcache_refill(struct thread_cache *tc, const int cls)
+{
+        struct tcache_bin *bin = &tc->bins[cls];
+        const unsigned limit = tcache_bin_limit(cls);
+        void *ptr;
+        long n = 0;
+
+        bin->refills++;
+
+        if (++bin->misses >= TCACHE_GROW_MISSES && bin->max < limit) {
+                bin->max = (bin->max * 2 > limit) ? limit : bin->max * 2;
+                bin->misses = 0;
+        }
+
+        const size_t cap = __atomic_load_n(&tc->pool->cap, __ATOMIC_RELAXED);
+        unsigned batch = (bin->max / 2 > 0) ? bin->max / 2 : 1;
+
+        /* a batch would take the pool above its cap: serve the one block */
+        if (cap != 0 && __atomic_load_n(&tc->pool->cached, __ATOMIC_RELAXED) +
+                        (batch - 1) * tcache_class_size(cls) > cap)
+                batch = 1;
+
+        tcache_pool_lock(tc->pool);
+
+        ptr = tcache_backend_alloc(tc->pool, cls);
+
+        while (ptr != NULL && (unsigned)n + 1 < batch) {
+                void *blk = tcache_backend_alloc(tc->pool, cls);
+
+                if (blk == NULL)
+                        break;
+
+                *(void **)blk = bin->head;
+                bin->head = blk;
+                bin->count++;
+                n++;
+        }
+
+        tcache_pool_unlock(tc->pool);
+
+        tcache_account(tc, cls, n);
+
+        return ptr;
+}
+
+/* NULL if nbytes is above the largest class, or out of memory */
+void *tcache_alloc(struct thread_cache *tc, size_t nbytes)
+{
+        const int cls = tcache_class(tc->pool, nbytes);
+
+        if (cls == -1)
+                return NULL;
+
+        tcache_event(tc);
+
+        struct tcache_bin *bin = &tc->bins[cls];
+        void *ptr = bin->head;
+
+        if (ptr == NULL)
+                return tcache_refill(tc, cls);
+
+        bin->head = *(void **)ptr;
+        bin->count--;
+
+        if (bin->low > bin->count)
+                bin->low = bin->count;
+
+        tcache_account(tc, cls, -1);
+
+        return ptr;
+}
+
+/* the pool is above its cap after a free into bin cls: flush the bin down to max / 2,
+ * then by halves, until under the cap. if the bin does not hold enough, the other
+ * caches are requested to shrink */
+void tcache_over_cap(struct thread_cache *tc, const int cls, const size_t cap)
+{
+        struct tcache_bin *bin = &tc->bins[cls];
+        unsigned keep = bin->max / 2;
+
+        for (;;) {
+                tcache_flush(tc, cls, keep);
+
+                if (__atomic_load_n(&tc->pool->cached, __ATOMIC_RELAXED) <= cap)
+                        return;
+                if (bin->count == 0)
+                        break;
+
+                keep = bin->count / 2;
+        }
+
+        tcache_rebalance(tc);
+}
+
+/* nbytes is the size of the allocation */
+void tcache_free(struct thread_cache *tc, void *ptr, size_t nbytes)
+{
+        const int cls = tcache_class(tc->pool, nbytes);
+
+        if (ptr == NULL || cls == -1)
+                return;
+
+        tcache_event(tc);
+
+        struct tcache_bin *bin = &tc->bins[cls];
+
+        *(void **)ptr = bin->head;
+        bin->head = ptr;
+        bin->count++;
+        tcache_account(tc, cls, 1);
+
+        if (bin->count > bin->max)
+                tcache_flush(tc, cls, bin->max / 2);
+
+        const size_t cap = __atomic_load_n(&tc->pool->cap, __ATOMIC_RELAXED);
+
+        if (cap != 0 && __atomic_load_n(&tc->pool->cached, __ATOMIC_RELAXED) > cap)
+                tcache_over_cap(tc, cls, cap);
+}
+
+/* give every cached block back to the pool */
+void thread_cache_flush(struct thread_cache *tc)
+{
+        for (int i = 0; i < TCACHE_NCLASSES; i++) {
+                tcache_flush(tc, i, 0);
+                tc->bins[i].low = 0;
+        }
+}
+
+void thread_cache_term(struct thread_cache *tc)
+{
+        struct tcache_pool *p = tc->pool;
+
+        thread_cache_flush(tc);
+
+        tcache_pool_lock(p);
+
+        for (struct thread_cache **link = &p->caches; *link != NULL; link = &(*link)->next) {
+                if (*link == tc) {
+                        *link = tc->next;
+                        p->ncaches--;
+                        break;
+                }
+        }
+
+        /* the counters of the pool keep counting the work of the cache */
+        for (int i = 0; i < TCACHE_NCLASSES; i++) {
+                p->refills[i] += tc->bins[i].refills;
+                p->flushes[i] += tc->bins[i].flushes;
+        }
+
+        tcache_pool_unlock(p);
+}
+
+#endif
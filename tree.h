@@ -0,0 +1,165 @@
+/* tree.h - intrusive binary search tree (treap) */
+
+#ifndef TREE_H
+#define TREE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define tree_entry(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+/* A treap: a binary search tree ordered by the comparison function, and a heap
+ * ordered by a priority derived from the address of each node, which keeps the
+ * tree balanced in expectation. The nodes are embedded in the user structures; the
+ * keys must be unique under the comparison function. */
+
+struct tree_node {
+        struct tree_node *left;
+        struct tree_node *right;
+        uint32_t prio;
+};
+
+typedef int (*tree_cmp_fn)(const struct tree_node *a, const struct tree_node *b);
+
+struct tree {
+        struct tree_node *root;
+        tree_cmp_fn cmp;
+};
+
+void tree_init(struct tree *t, tree_cmp_fn cmp)
+{
+        t->root = NULL;
+        t->cmp = cmp;
+}
+
+uint32_t tree_priority(const struct tree_node *n)
+{
+        uint64_t k = (uintptr_t)n;
+
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33;
+
+        return (uint32_t)k;
+}
+
+struct tree_node *tree_rotate_right(struct tree_node *n)
+{
+        struct tree_node *l = n->left;
+
+        n->left = l->right;
+        l->right = n;
+
+        return l;
+}
+
+struct tree_node *tree_rotate_left(struct tree_node *n)
+{
+        struct tree_node *r = n->right;
+
+        n->right = r->left;
+        r->left = n;
+
+        return r;
+}
+
+struct tree_node *tree_insert_at(struct tree *t, struct tree_node *root, struct tree_node *n)
+{
+        if (root == NULL)
+                return n;
+
+        if (t->cmp(n, root) < 0) {
+                root->left = tree_insert_at(t, root->left, n);
+
+                if (root->left->prio > root->prio)
+                        root = tree_rotate_right(root);
+        } else {
+                root->right = tree_insert_at(t, root->right, n);
+
+                if (root->right->prio > root->prio)
+                        root = tree_rotate_left(root);
+        }
+
+        return root;
+}
+
+void tree_insert(struct tree *t, struct tree_node *n)
+{
+        n->left = NULL;
+        n->right = NULL;
+        n->prio = tree_priority(n);
+
+        t->root = tree_insert_at(t, t->root, n);
+}
+
+struct tree_node *tree_remove_at(struct tree *t, struct tree_node *root, struct tree_node *n)
+{
+        if (root == NULL)
+                return NULL;
+
+        if (root != n) {
+                if (t->cmp(n, root) < 0)
+                        root->left = tree_remove_at(t, root->left, n);
+                else
+                        root->right = tree_remove_at(t, root->right, n);
+
+                return root;
+        }
+
+        if (root->left == NULL)
+                return root->right;
+        if (root->right == NULL)
+                return root->left;
+
+        /* rotate the node down, keeping the child of highest priority above */
+        if (root->left->prio > root->right->prio) {
+                root = tree_rotate_right(root);
+                root->right = tree_remove_at(t, root->right, n);
+        } else {
+                root = tree_rotate_left(root);
+                root->left = tree_remove_at(t, root->left, n);
+        }
+
+        return root;
+}
+
+void tree_remove(struct tree *t, struct tree_node *n)
+{
+        t->root = tree_remove_at(t, t->root, n);
+}
+
+/* smallest node not less than key, or NULL */
+struct tree_node *tree_lower_bound(struct tree *t, const struct tree_node *key)
+{
+        struct tree_node *n = t->root, *best = NULL;
+
+        while (n != NULL) {
+                if (t->cmp(n, key) < 0) {
+                        n = n->right;
+                } else {
+                        best = n;
+                        n = n->left;
+                }
+        }
+
+        return best;
+}
+
+/* largest node less than key, or NULL */
+struct tree_node *tree_predecessor(struct tree *t, const struct tree_node *key)
+{
+        struct tree_node *n = t->root, *best = NULL;
+
+        while (n != NULL) {
+                if (t->cmp(n, key) < 0) {
+                        best = n;
+                        n = n->right;
+                } else {
+                        n = n->left;
+                }
+        }
+
+        return best;
+}
+
+#endif
@@ -0,0 +1,146 @@
+/* ttl_arena.h -- Arenas of cache entries bucketed by expiry time, dropped whole
+ *
+ * MIT License
+ * Copyright (c) 2024 arogez
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef TTL_ARENA_H
+#define TTL_ARENA_H
+
+#include "heap.h"
+#include "scratch_allocator.h"
+
+/* Design of the system:
+ *      Time is cut in buckets of granularity units (the unit is the caller's: ms, ticks).
+ *      Bucket e holds the entries expiring in ((e - 1) * granularity, e * granularity];
+ *      each bucket is a scratch chain, entries are bump allocated and never freed one by
+ *      one. The buckets form a ring covering nbuckets * granularity units from the oldest
+ *      live bucket (epoch):
+ *
+ *      buckets:  [e+2] [e+3] [e]  [e+1]     epoch = e
+ *                             ^ dropped first, when now >= e * granularity
+ *
+ *      ttl_arena_expire() drops every bucket whose time has passed: its chain is reset,
+ *      which costs one free per chunk whatever the number of entries, and the slot is
+ *      reused for the bucket entering the ring. An entry is never dropped before its
+ *      expiry, at most one granularity after it. An expiry past the end of the ring is
+ *      refused, an expiry already past goes to the oldest bucket.
+ */
+
+struct ttl_arena {
+        struct heap             *h;
+        struct scratch_chain    *buckets;
+        unsigned                nbuckets;
+        uint64_t                granularity;
+        uint64_t                epoch;
+};
+
+int ttl_arena_init(struct ttl_arena *t, struct heap *h, unsigned nbuckets, uint64_t granularity,
+                   size_t chunk_size, size_t alignment, uint64_t now)
+{
+        if (nbuckets == 0 || granularity == 0 || chunk_size == 0)
+                return -1;
+        if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+                return -1;
+
+        t->buckets = heap_alloc(h, nbuckets * sizeof(struct scratch_chain));
+
+        if (t->buckets == NULL)
+                return -1;
+
+        t->h = h;
+        t->nbuckets = nbuckets;
+        t->granularity = granularity;
+        t->epoch = now / granularity;
+
+        /* chunks are allocated on first use, see scratch_chain_alloc() */
+        for (unsigned i = 0; i < nbuckets; i++) {
+                t->buckets[i].h = h;
+                t->buckets[i].chunk_size = chunk_size;
+                t->buckets[i].alignment = alignment;
+                t->buckets[i].chunks = NULL;
+        }
+
+        return 0;
+}
+
+/* bucket index of an expiry time, rounded up */
+uint64_t ttl_bucket(struct ttl_arena *t, uint64_t expiry)
+{
+        /* not (expiry + granularity - 1) / granularity, which wraps near UINT64_MAX */
+        const uint64_t e = expiry / t->granularity + (expiry % t->granularity != 0);
+
+        return (e < t->epoch) ? t->epoch : e;
+}
+
+/* time at which an entry expiring at expiry is dropped */
+uint64_t ttl_drop_time(struct ttl_arena *t, uint64_t expiry)
+{
+        const uint64_t e = ttl_bucket(t, expiry);
+
+        return (e > UINT64_MAX / t->granularity) ? UINT64_MAX : e * t->granularity;
+}
+
+void *ttl_alloc(struct ttl_arena *t, size_t nbytes, size_t alignment, uint64_t expiry)
+{
+        const uint64_t e = ttl_bucket(t, expiry);
+
+        if (e >= t->epoch + t->nbuckets) {
+                if (t->h->hft & HEAP_DEBUG)
+                        printf("ttl_arena info: expiry past the last bucket\n");
+                return NULL;
+        }
+
+        return scratch_chain_alloc(&t->buckets[e % t->nbuckets], nbytes, alignment);
+}
+
+/* drop the buckets whose time has passed. returns the number of buckets dropped */
+unsigned ttl_arena_expire(struct ttl_arena *t, uint64_t now)
+{
+        unsigned n = 0;
+
+        while (t->epoch * t->granularity <= now) {
+                /* an idle ring catches up without walking every elapsed bucket */
+                if (n == t->nbuckets) {
+                        t->epoch = now / t->granularity + 1;
+                        break;
+                }
+
+                scratch_chain_reset(&t->buckets[t->epoch % t->nbuckets]);
+                t->epoch++;
+                n++;
+        }
+
+        return n;
+}
+
+void ttl_arena_term(struct ttl_arena *t)
+{
+        if (t == NULL || t->buckets == NULL)
+                return;
+
+        for (unsigned i = 0; i < t->nbuckets; i++)
+                scratch_chain_term(&t->buckets[i]);
+
+        heap_free(t->h, t->buckets);
+        t->buckets = NULL;
+}
+
+#endif